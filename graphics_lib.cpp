@@ -1,7 +1,11 @@
 #include <GL/gl.h>
 #include <GL/glut.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <ctype.h>
 #include <iostream>
 #include <deque>
 #include <math.h>
@@ -9,11 +13,40 @@
 #include <cmath>
 #include <algorithm>
 #include <set>
+#include <vector>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 //Defines
 // min max functions
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define min(a, b) ((a) < (b) ? (a) : (b))
+// 64-bit fixed point used for line and edge stepping so large canvases don't overflow, the 32 fraction bits keep
+// rounding drift far below a pixel on 50000 pixel lines but round about one pixel per line differently from 16.16
+#define FIXED_SHIFT 32
+#define FIXED_HALF ((int64_t)1 << (FIXED_SHIFT - 1))
+// Tile dimensions of tiled surfaces
+#define TILE_SHIFT 8
+#define TILE_SIZE (1 << TILE_SHIFT)
+#define TILE_MASK (TILE_SIZE - 1)
+// Markers are bucketed into bands of rows for cache friendly drawing
+#define MARKER_BAND_SHIFT 4
+// Maximum distance in pixels between an anti-aliased ellipse and its flattened outline
+#define AA_ARC_TOLERANCE 0.05
+// Geometry file vertices have to lie within this many pixels of the origin, so spans and edge tables can't overflow
+#define GEOMETRY_COORD_LIMIT (1 << 24)
+// Golden image harness canvas size, shapes drawn per case and timing rounds, the fastest round counts
+#define GOLDEN_SIZE 256
+#define GOLDEN_SHAPES 24
+#define GOLDEN_ROUNDS 5
 
 // Typedefs
 // rgb color struct
@@ -32,20 +65,412 @@ typedef std::deque<TImageCoordPair> TImageCoordList;
 typedef struct Edge
 {
   int yMax;
-  float dx, slope;
+  int64_t dx, slope;
   struct Edge *next;
 } Edge;
 
+// Streaming edge table builder, polygon vertices are fed one at a time and the wrap around edges are added on close,
+// every added edge is also collected as a pair of endpoints into outline when it is set
+typedef struct EdgeTableBuilder
+{
+  Edge **edgeTable;
+  std::vector<TImageCoordPair> *outline;
+  int yOffset;
+  int count;
+  int thirdY, prev3Y;
+  bool hasPending;
+  TImageCoordPair first, second, prev2, prev1, pending;
+} EdgeTableBuilder;
+
+// Cell of the sparse signed area accumulation buffer, coverage of a pixel is the running sum of the cells up to it in its row
+typedef struct CoverageCell
+{
+  int y, x;
+  float area;
+} CoverageCell;
+
+// Sparse signed area accumulation buffer used by the anti-aliased drawing mode, only cells crossed by edges are stored
+typedef struct CoverageBuffer
+{
+  int width, height, minRow, maxRow;
+  std::vector<CoverageCell> cells, sorted;
+  std::vector<int> rowStart;
+  std::vector<double> points;
+} CoverageBuffer;
+
+// Lazy pixel iterator over a basic 1px line, yields the pattern set pixels in drawing order
+typedef struct LineIterator
+{
+  bool yLonger;
+  int pos, end, step;
+  int64_t j, inc;
+  uint32_t pattern;
+} LineIterator;
+
+// Lazy pixel iterator over a basic 1px full ellipse, every pattern step yields up to four mirrored pixels
+typedef struct EllipseIterator
+{
+  int x0, y0, x1, y1, b;
+  long long dx, dy, err, a8, b8;
+  int phase, next, count;
+  int px[4], py[4];
+  uint32_t pattern;
+} EllipseIterator;
+
+// Lazy span iterator over a filled ellipse or sector, yields runs of covered pattern set pixels row by row
+typedef struct PieIterator
+{
+  int x, y, rx, ry, scanx, scany;
+  long long rx2, ry2;
+  unsigned long long rxry;
+  int a1x, a1y, a2x, a2y;
+  bool reflex;
+  uint32_t rowPattern;
+  std::deque<uint32_t>::iterator patternIter;
+} PieIterator;
+
+// Lazy span iterator over a built edge table, takes ownership of the edges and frees them as rows are passed
+typedef struct FillSpanIterator
+{
+  Edge **edgeTable;
+  Edge *activeList, *current;
+  int minY, maxY, firstY, lastY, scan, count, spanX, spanEnd;
+  bool rowStarted, ownsTable;
+  uint32_t rowPattern, spanPattern;
+  std::deque<uint32_t>::iterator patternIter;
+} FillSpanIterator;
+
+// Path commands, control points come before the end point
+enum PathVerb
+{
+  PATH_MOVE,
+  PATH_LINE,
+  PATH_QUAD,
+  PATH_CUBIC,
+  PATH_CLOSE
+};
+
+// Single path command with up to three points
+typedef struct PathCommand
+{
+  PathVerb verb;
+  int x[3], y[3];
+} PathCommand;
+
+// Path made of straight, quadratic and cubic segments
+typedef std::vector<PathCommand> TPath;
+
+// Receiver of flattened path vertices, either an outline being stroked or an edge table being built
+typedef struct PathSink
+{
+  EdgeTableBuilder *builder;
+  bool started, endPoints;
+  TImageCoordPair last;
+} PathSink;
+
+// Software render target that pixels are routed to instead of opengl when bound
+typedef struct RenderTarget
+{
+  int width, height;
+  void (*plot)(struct RenderTarget *target, int x, int y, color col, int alpha);
+  // Optional fast path for horizontal runs, NULL falls back to plot
+  void (*span)(struct RenderTarget *target, int x, int y, int length, color col, int alpha);
+} RenderTarget;
+
+// Sparse surface made of RGBA8 tiles that are only allocated once drawn to
+typedef struct TiledSurface
+{
+  RenderTarget target;
+  int tilesX, tilesY;
+  uint8_t **tiles;
+  uint8_t clear[4];
+  size_t allocatedTiles;
+} TiledSurface;
+
+// Pixel layouts of images, PPM and PAM files carry their header in front of the pixel rows
+enum ImageFormat
+{
+  IMAGE_RAW_RGBA,
+  IMAGE_RAW_RGB,
+  IMAGE_PPM,
+  IMAGE_PAM
+};
+
+// Dense RGB8 or RGBA8 image whose pixel rows are written in place, optionally inside a memory mapped file
+typedef struct Image
+{
+  RenderTarget target;
+  int channels;
+  size_t stride;
+  uint8_t *pixels;
+  void *map;
+  size_t mapSize;
+} Image;
+
+// Horizontal run of identically colored pixels relative to a stamp's center
+typedef struct StampRun
+{
+  int x, y, length;
+  color col;
+  int alpha;
+} StampRun;
+
+// Rasterized shape held by the stamp cache, runs are kept in draw order so blending stays exact
+typedef struct StampEntry
+{
+  std::string key;
+  std::vector<StampRun> runs;
+  size_t bytes;
+} StampEntry;
+
+// Render target that records pixels as stamp runs relative to an origin
+typedef struct StampRecorder
+{
+  RenderTarget target;
+  int originX, originY;
+  std::vector<StampRun> *runs;
+} StampRecorder;
+
+// Marker shapes drawn by DrawMarkers
+enum MarkerShape
+{
+  MARKER_PIXEL,
+  MARKER_SQUARE,
+  MARKER_CIRCLE
+};
+
+// Row of a marker as a run relative to its center
+typedef struct MarkerRow
+{
+  int dy, dx, length;
+} MarkerRow;
+
+// Drawing state captured along with retained shapes
+typedef struct DrawState
+{
+  int lineWidth;
+  uint32_t linePattern;
+  std::deque<uint32_t> fillPattern;
+  color pixelColor1, pixelColor2;
+  int alphaChannel1, alphaChannel2;
+  int antiAlias;
+} DrawState;
+
+// Kinds of shapes a scene can hold, one per drawing interface
+enum SceneShapeKind
+{
+  SHAPE_LINE,
+  SHAPE_RECT,
+  SHAPE_BOX,
+  SHAPE_POLY,
+  SHAPE_FILLED_POLY,
+  SHAPE_ELLIPSE,
+  SHAPE_PIE
+};
+
+// Shape retained by a scene, x1/y1/x2/y2 hold corners or center and radii, flag holds omitEndpoints or radii
+typedef struct SceneShape
+{
+  SceneShapeKind kind;
+  int x1, y1, x2, y2;
+  int a1, a2, flag;
+  TImageCoordList coords;
+  DrawState state;
+} SceneShape;
+
+// Node of a scene's dynamic bounding volume hierarchy, leaves have no children and point at a shape
+typedef struct SceneNode
+{
+  int minX, minY, maxX, maxY;
+  int parent, left, right;
+  int height;
+  int shape;
+} SceneNode;
+
+// Retained scene of shapes indexed by a dynamic AABB tree that is balanced incrementally on insert and remove
+typedef struct Scene
+{
+  std::vector<SceneNode> nodes;
+  std::vector<int> freeNodes;
+  int root;
+  std::vector<SceneShape> shapes;
+  std::vector<int> leafOf;
+  std::vector<unsigned long> drawOrder;
+  std::vector<int> freeShapes;
+  unsigned long nextOrder;
+} Scene;
+
+// Bitmap of pixels owned by a later opaque pixel, one bit per pixel over a region of the canvas
+typedef struct OcclusionMask
+{
+  int minX, minY, width, height, words;
+  std::vector<uint64_t> bits;
+} OcclusionMask;
+
+// Open overdraw elimination pass, drawing is recorded and only reaches the bound target when the pass ends
+typedef struct OcclusionPass
+{
+  StampRecorder recorder;
+  std::vector<StampRun> runs;
+  RenderTarget *target;
+  int active;
+} OcclusionPass;
+
+// Polygon in source units with simplified levels of detail built lazily, level n is simplified to a 2^n tolerance
+typedef struct PolyLod
+{
+  TImageCoordList source;
+  std::map<int, TImageCoordList> levels;
+} PolyLod;
+
+// Vertex types of binary geometry files
+enum GeometryVertexType
+{
+  GEOMETRY_INT32,
+  GEOMETRY_FLOAT32
+};
+
+// Header of a binary geometry file, followed by polygonCount + 1 vertex start indices and packed x, y vertex pairs
+typedef struct GeometryHeader
+{
+  char magic[8];
+  uint32_t vertexType;
+  uint32_t reserved;
+  uint64_t polygonCount;
+  uint64_t indexOffset;
+  uint64_t vertexOffset;
+} GeometryHeader;
+
+// Memory mapped binary geometry file
+typedef struct GeometryFile
+{
+  const uint8_t *map;
+  size_t size;
+  GeometryHeader header;
+  const uint64_t *index;
+  const uint8_t *vertices;
+} GeometryFile;
+
+// Zero copy view of a polygon's packed vertices
+typedef struct PolyView
+{
+  const void *xy;
+  size_t count;
+  GeometryVertexType vertexType;
+} PolyView;
+
+// Shapes the stamp cache knows how to rasterize
+enum StampKind
+{
+  STAMP_ELLIPSE,
+  STAMP_PIE
+};
+
+// Batch commands, one per drawing interface and state setting
+enum BatchOp
+{
+  BATCH_IMAGE,
+  BATCH_CLEAR,
+  BATCH_COLOR1,
+  BATCH_COLOR2,
+  BATCH_ALPHA1,
+  BATCH_ALPHA2,
+  BATCH_LINE_WIDTH,
+  BATCH_LINE_PATTERN,
+  BATCH_FILL_PATTERN,
+  BATCH_ANTI_ALIAS,
+  BATCH_CURVE_TOLERANCE,
+  BATCH_STAMP_CACHE,
+  BATCH_PIXEL,
+  BATCH_LINE,
+  BATCH_RECT,
+  BATCH_BOX,
+  BATCH_POLY,
+  BATCH_FILLED_POLY,
+  BATCH_ELLIPSE,
+  BATCH_PIE,
+  BATCH_BEZIER,
+  BATCH_PATH,
+  BATCH_FILLED_PATH,
+  BATCH_MARKERS,
+  BATCH_GEOMETRY
+};
+
+// Name and numeric argument counts of a batch command, -1 allows any number
+typedef struct BatchCommandInfo
+{
+  const char *name;
+  BatchOp op;
+  int minArgs, maxArgs;
+} BatchCommandInfo;
+
+// Parsed batch command, numeric arguments and the optional word point into shared buffers
+typedef struct BatchCommand
+{
+  BatchOp op;
+  int line;
+  size_t arg, argCount;
+  size_t word, wordLen;
+} BatchCommand;
+
+// One image of a batch, its lines in the command text and how long each stage took
+typedef struct BatchJob
+{
+  size_t begin, end;
+  int line;
+  int failed;
+  double parseTime, renderTime, writeTime;
+} BatchJob;
+
+// Render worker of a batch, every buffer is kept from image to image so steady state rendering does not allocate
+typedef struct BatchWorker
+{
+  Image *image;
+  std::vector<BatchCommand> commands;
+  std::vector<double> args;
+  std::string word;
+  TImageCoordList coords;
+  TPath path;
+  std::vector<int> points;
+} BatchWorker;
+
 // Test params
+// Drawing state is per thread so headless render threads never share it
 int winw = 1000;
 int winh = 1000;
-int alphaChannel1 = 255;
-int alphaChannel2 = 128;
-color pixelColor1 = {255, 255, 255};
-color pixelColor2 = {255, 0, 0};
-int lineWidth = 1;
-uint32_t linePattern = 0xFFF00FFFU;
-std::deque<uint32_t> fillPattern = {0x00000000U, 0x00F00F00U, 0x00F00F00U, 0x00F00F00U, 0x00F00F00U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x00FFFF00U, 0x00FFFF00U, 0x00FFFF00U, 0x00FFFF00U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x00000000U};
+thread_local int alphaChannel1 = 255;
+thread_local int alphaChannel2 = 128;
+thread_local color pixelColor1 = {255, 255, 255};
+thread_local color pixelColor2 = {255, 0, 0};
+thread_local int lineWidth = 1;
+// Anti-aliased lines, polygons, ellipses and pies with exact area coverage, patterns are not applied in this mode
+thread_local int antiAlias = 0;
+// Maximum distance in pixels between a curve and its flattened segments
+thread_local double curveTolerance = 0.25;
+// Level of detail view, pixels per source unit, pixel offset and simplification tolerance in pixels
+thread_local double lodScale = 1.0;
+thread_local int lodOffsetX = 0;
+thread_local int lodOffsetY = 0;
+thread_local double lodTolerance = 0.5;
+thread_local uint32_t linePattern = 0xFFF00FFFU;
+thread_local RenderTarget *renderTarget = NULL;
+// Stamp cache memory cap in bytes, 0 disables caching
+thread_local size_t stampCacheLimit = 0;
+thread_local size_t stampCacheBytes = 0;
+thread_local unsigned long stampCacheHits = 0;
+thread_local unsigned long stampCacheMisses = 0;
+// Worker threads used by DrawMarkers on dense images, 0 uses every hardware thread
+thread_local int markerThreads = 0;
+// DrawScene resolves visibility back to front and skips whatever a later opaque pixel overwrites
+thread_local int sceneOcclusion = 0;
+thread_local unsigned long occludedPixels = 0;
+thread_local unsigned long occludedShapes = 0;
+thread_local OcclusionPass occlusionPass;
+thread_local std::list<StampEntry> stampCache;
+// Coverage cells are kept between anti-aliased shapes so their storage is reused
+thread_local CoverageBuffer coverageBuffer;
+thread_local std::unordered_map<std::string, std::list<StampEntry>::iterator> stampCacheIndex;
+thread_local std::deque<uint32_t> fillPattern = {0x00000000U, 0x00F00F00U, 0x00F00F00U, 0x00F00F00U, 0x00F00F00U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x0FFFFFF0U, 0x00FFFF00U, 0x00FFFF00U, 0x00FFFF00U, 0x00FFFF00U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x000FF000U, 0x00000000U};
 
 // Used to rotate through pattern and return pixel flag
 int GetAndRotatePixelFlag(uint32_t *pattern)
@@ -64,7 +489,15 @@ int GetAndRotatePixelFlag(uint32_t *pattern)
 // Interface to get canvas size
 int GetCanvasSize(int *x, int *y)
 {
-  if (winw > 0 && winh > 0)
+  // Bound render target takes precedence over the window
+  if (renderTarget != NULL && renderTarget->width > 0 && renderTarget->height > 0)
+  {
+    *x = renderTarget->width;
+    *y = renderTarget->height;
+    return 0;
+  }
+
+  if (renderTarget == NULL && winw > 0 && winh > 0)
   {
     *x = winw;
     *y = winh;
@@ -78,140 +511,835 @@ int GetCanvasSize(int *x, int *y)
 // Interface to draw pixels
 void DrawPixel(int x, int y, color col = pixelColor1, int alpha = alphaChannel1)
 {
+  if (renderTarget != NULL)
+  {
+    renderTarget->plot(renderTarget, x, y, col, alpha);
+    return;
+  }
+
   glBegin(GL_POINTS);
   glColor4ub(col.red, col.green, col.blue, alpha);
   glVertex2i(x, y);
   glEnd();
 }
 
-// Subprocess that draws a basic 1px thick line using addition fixed point with precalculations implementation of EFLA
-void DrawBasicLine(int x1, int y1, int x2, int y2, uint32_t pattern = -1L)
+// Subprocess that draws a horizontal run of pixels
+void DrawSpan(int x, int y, int length, color col, int alpha)
 {
-  bool yLonger = false;
-  int shortLen = y2 - y1;
-  int longLen = x2 - x1;
-  int pixelFlag;
-
-  if (abs(shortLen) > abs(longLen))
+  if (renderTarget != NULL)
   {
-    int swap = shortLen;
-    shortLen = longLen;
-    longLen = swap;
-    yLonger = true;
+    if (renderTarget->span != NULL)
+      renderTarget->span(renderTarget, x, y, length, col, alpha);
+    else
+      for (int i = 0; i < length; i++)
+        renderTarget->plot(renderTarget, x + i, y, col, alpha);
+    return;
   }
 
-  // Precalculation of incremental step
-  int decInc = longLen == 0 ? 0 : (shortLen << 16) / longLen;
+  glBegin(GL_POINTS);
+  glColor4ub(col.red, col.green, col.blue, alpha);
+  for (int i = 0; i < length; i++)
+    glVertex2i(x + i, y);
+  glEnd();
+}
+
+// Subprocess that blends a color into a pixel the same way as glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA)
+void BlendPixel(uint8_t *px, int channels, color col, int alpha)
+{
+  int a = (uint8_t)alpha;
+  int inv = 255 - a;
 
-  // Handling if line is taller than wide
-  if (yLonger)
+  // Opaque pixels simply overwrite
+  if (a == 255)
   {
-    // Handling for right to left direction
-    if (longLen > 0)
-    {
-      longLen += y1;
-      for (int j = 0x8000 + (x1 << 16); y1 <= longLen; ++y1)
-      {
-        pixelFlag = GetAndRotatePixelFlag(&pattern);
-        if (pixelFlag)
-        {
-          DrawPixel(abs(j >> 16), y1, pixelColor1, alphaChannel1);
-        }
-        j += decInc;
-      }
-      return;
-    }
+    px[0] = col.red;
+    px[1] = col.green;
+    px[2] = col.blue;
+    if (channels > 3)
+      px[3] = 255;
+    return;
+  }
 
-    // Handling for left to right direction
-    longLen += y1;
-    for (int j = 0x8000 + (x1 << 16); y1 >= longLen; --y1)
-    {
-      pixelFlag = GetAndRotatePixelFlag(&pattern);
-      if (pixelFlag)
-      {
-        DrawPixel(abs(j >> 16), y1, pixelColor1, alphaChannel1);
-      }
-      j -= decInc;
-    }
+  px[0] = ((uint8_t)col.red * a + px[0] * inv + 127) / 255;
+  px[1] = ((uint8_t)col.green * a + px[1] * inv + 127) / 255;
+  px[2] = ((uint8_t)col.blue * a + px[2] * inv + 127) / 255;
+  if (channels > 3)
+    px[3] = (a * a + px[3] * inv + 127) / 255;
+}
+
+// Subprocess that returns a tile of a tiled surface, allocating and clearing it on first touch if asked to
+uint8_t *GetTile(TiledSurface *surface, int tx, int ty, int allocate)
+{
+  uint8_t **slot = &surface->tiles[(size_t)ty * surface->tilesX + tx];
+
+  if (*slot != NULL || !allocate)
+    return *slot;
+
+  uint8_t *tile = (uint8_t *)malloc(TILE_SIZE * TILE_SIZE * 4);
+  if (tile == NULL)
+    return NULL;
+
+  for (int i = 0; i < TILE_SIZE * TILE_SIZE * 4; i += 4)
+    memcpy(tile + i, surface->clear, 4);
+
+  surface->allocatedTiles++;
+  *slot = tile;
+  return tile;
+}
+
+// Subprocess that plots a pixel into a tiled surface
+void PlotTiled(RenderTarget *target, int x, int y, color col, int alpha)
+{
+  if (x < 0 || y < 0 || x >= target->width || y >= target->height)
     return;
+
+  uint8_t *tile = GetTile((TiledSurface *)target, x >> TILE_SHIFT, y >> TILE_SHIFT, 1);
+  if (tile != NULL)
+    BlendPixel(tile + (((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK)) * 4, 4, col, alpha);
+}
+
+// Interface to create a sparse tiled surface, returns NULL on failure
+TiledSurface *CreateTiledSurface(int width, int height, color clearColor = {0, 0, 0}, int clearAlpha = 0)
+{
+  if (width <= 0 || height <= 0)
+    return NULL;
+
+  TiledSurface *surface = (TiledSurface *)malloc(sizeof(TiledSurface));
+  if (surface == NULL)
+    return NULL;
+
+  surface->target.width = width;
+  surface->target.height = height;
+  surface->target.plot = PlotTiled;
+  surface->target.span = NULL;
+  surface->tilesX = (width + TILE_MASK) >> TILE_SHIFT;
+  surface->tilesY = (height + TILE_MASK) >> TILE_SHIFT;
+  surface->tiles = (uint8_t **)calloc((size_t)surface->tilesX * surface->tilesY, sizeof(uint8_t *));
+  surface->clear[0] = clearColor.red;
+  surface->clear[1] = clearColor.green;
+  surface->clear[2] = clearColor.blue;
+  surface->clear[3] = clearAlpha;
+  surface->allocatedTiles = 0;
+
+  if (surface->tiles == NULL)
+  {
+    free(surface);
+    return NULL;
+  }
+
+  return surface;
+}
+
+// Interface to release a single tile, it reads back as the clear color afterwards
+void ReleaseTile(TiledSurface *surface, int tx, int ty)
+{
+  uint8_t **slot = &surface->tiles[(size_t)ty * surface->tilesX + tx];
+
+  if (*slot != NULL)
+  {
+    free(*slot);
+    *slot = NULL;
+    surface->allocatedTiles--;
   }
+}
+
+// Interface to free a tiled surface and all of its tiles
+void FreeTiledSurface(TiledSurface *surface)
+{
+  if (surface == NULL)
+    return;
+
+  if (renderTarget == &surface->target)
+    renderTarget = NULL;
+
+  for (int ty = 0; ty < surface->tilesY; ty++)
+    for (int tx = 0; tx < surface->tilesX; tx++)
+      ReleaseTile(surface, tx, ty);
+
+  free(surface->tiles);
+  free(surface);
+}
+
+// Interface to read back a pixel of a tiled surface, untouched tiles return the clear color
+int ReadTiledPixel(TiledSurface *surface, int x, int y, uint8_t *rgba)
+{
+  if (x < 0 || y < 0 || x >= surface->target.width || y >= surface->target.height)
+    return -1;
+
+  uint8_t *tile = GetTile(surface, x >> TILE_SHIFT, y >> TILE_SHIFT, 0);
+  if (tile == NULL)
+    memcpy(rgba, surface->clear, 4);
+  else
+    memcpy(rgba, tile + (((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK)) * 4, 4);
+
+  return 0;
+}
 
-  // Handling if line is wider than tall
-  // Handling for right to left direction
-  if (longLen > 0)
+// Interface to stream one finished row of tiles as binary PPM pixel rows, optionally releasing the tiles afterwards
+int StreamTileRow(TiledSurface *surface, int ty, FILE *out, int release)
+{
+  int width = surface->target.width;
+  int y1 = ty << TILE_SHIFT;
+  int y2 = min(y1 + TILE_SIZE, surface->target.height);
+  uint8_t *row = (uint8_t *)malloc((size_t)width * 3);
+
+  if (row == NULL)
+    return -1;
+
+  for (int y = y1; y < y2; y++)
   {
-    longLen += x1;
-    for (int j = 0x8000 + (y1 << 16); x1 <= longLen; ++x1)
+    for (int tx = 0; tx < surface->tilesX; tx++)
     {
-      pixelFlag = GetAndRotatePixelFlag(&pattern);
-      if (pixelFlag)
+      uint8_t *tile = GetTile(surface, tx, ty, 0);
+      int x2 = min((tx + 1) << TILE_SHIFT, width);
+
+      for (int x = tx << TILE_SHIFT; x < x2; x++)
       {
-        DrawPixel(x1, abs(j >> 16), pixelColor1, alphaChannel1);
+        uint8_t *src = tile == NULL ? surface->clear : tile + (((y & TILE_MASK) << TILE_SHIFT) + (x & TILE_MASK)) * 4;
+        memcpy(row + (size_t)x * 3, src, 3);
       }
-      j += decInc;
     }
-    return;
-  }
 
-  // Handling for left to right direction
-  longLen += x1;
-  for (int j = 0x8000 + (y1 << 16); x1 >= longLen; --x1)
-  {
-    pixelFlag = GetAndRotatePixelFlag(&pattern);
-    if (pixelFlag)
+    if (fwrite(row, 3, width, out) != (size_t)width)
     {
-      DrawPixel(x1, abs(j >> 16), pixelColor1, alphaChannel1);
+      free(row);
+      return -1;
     }
-    j -= decInc;
   }
+
+  free(row);
+
+  if (release)
+    for (int tx = 0; tx < surface->tilesX; tx++)
+      ReleaseTile(surface, tx, ty);
+
+  return 0;
 }
 
-// Interface for drawing lines
-void DrawLine(int x1, int y1, int x2, int y2, int omitEndpoints = 0)
+// Interface to stream a whole tiled surface to a binary PPM file one row of tiles at a time
+int WriteTiledSurface(TiledSurface *surface, FILE *out, int release = 1)
 {
-  if (omitEndpoints)
+  if (fprintf(out, "P6\n%d %d\n255\n", surface->target.width, surface->target.height) < 0)
+    return -1;
+
+  for (int ty = 0; ty < surface->tilesY; ty++)
+    if (StreamTileRow(surface, ty, out, release))
+      return -1;
+
+  return 0;
+}
+
+// Subprocess that plots a pixel into a dense image
+void PlotImage(RenderTarget *target, int x, int y, color col, int alpha)
+{
+  if (x < 0 || y < 0 || x >= target->width || y >= target->height)
+    return;
+
+  Image *image = (Image *)target;
+  BlendPixel(image->pixels + y * image->stride + (size_t)x * image->channels, image->channels, col, alpha);
+}
+
+// Subprocess that draws a clipped horizontal run into a dense image
+void SpanImage(RenderTarget *target, int x, int y, int length, color col, int alpha)
+{
+  if (y < 0 || y >= target->height)
+    return;
+
+  int x2 = min(x + length, target->width);
+  x = max(x, 0);
+
+  Image *image = (Image *)target;
+  uint8_t *px = image->pixels + y * image->stride + (size_t)x * image->channels;
+  for (; x < x2; x++, px += image->channels)
+    BlendPixel(px, image->channels, col, alpha);
+}
+
+// Interface to create an image render target in memory cleared to transparent black, returns NULL on failure
+Image *CreateImage(int width, int height, int channels = 4)
+{
+  if (width <= 0 || height <= 0 || (channels != 3 && channels != 4))
+    return NULL;
+
+  Image *image = (Image *)malloc(sizeof(Image));
+  if (image == NULL)
+    return NULL;
+
+  image->channels = channels;
+  image->stride = (size_t)width * channels;
+  image->pixels = (uint8_t *)calloc(height, image->stride);
+  image->map = NULL;
+  image->mapSize = 0;
+  image->target.width = width;
+  image->target.height = height;
+  image->target.plot = PlotImage;
+  image->target.span = SpanImage;
+
+  if (image->pixels == NULL)
   {
-    if (x1 > x2)
-    {
-      x1--;
-      x2++;
-    }
-    else if (x1 < x2)
-    {
-      x1++;
-      x2--;
-    }
-    if (y1 > y2)
-    {
-      y1--;
-      y2++;
-    }
-    else if (y1 < y2)
-    {
-      y1++;
-      y2--;
-    }
+    free(image);
+    return NULL;
   }
 
-  int dx = x2 - x1;
-  int dy = y2 - y1;
+  return image;
+}
 
-  // horizontal line
-  if (dx != 0 && dy == 0)
+// Interface to free an in memory image
+void FreeImage(Image *image)
+{
+  if (image == NULL)
+    return;
+
+  if (renderTarget == &image->target)
+    renderTarget = NULL;
+
+  free(image->pixels);
+  free(image);
+}
+
+// Interface to write a dense image as binary PPM, or as PAM when it has an alpha channel
+int WriteImage(Image *image, FILE *out)
+{
+  int width = image->target.width, height = image->target.height;
+  size_t row = (size_t)width * image->channels;
+
+  if (image->channels == 3)
   {
-    // Handling line width
-    for (int i = 1; i <= lineWidth; i++)
-    {
-      // Odd goes under
-      if (i & 1)
-        DrawBasicLine(x1, y1 - ((i - 1) / 2), x2, y2 - ((i - 1) / 2), linePattern);
-      // Even goes over
-      else
-        DrawBasicLine(x1, y1 + (i / 2), x2, y2 + (i / 2), linePattern);
-    }
+    if (fprintf(out, "P6\n%d %d\n255\n", width, height) < 0)
+      return -1;
   }
-  // vertical line
-  else if (dx == 0 && dy != 0)
+  else if (fprintf(out, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height) < 0)
+    return -1;
+
+  for (int y = 0; y < height; y++)
+    if (fwrite(image->pixels + y * image->stride, 1, row, out) != row)
+      return -1;
+
+  return 0;
+}
+
+// Interface to create an image render target that is a memory mapped file, canvas size is used if no size is given
+Image *CreateMappedImage(const char *path, ImageFormat format, int width = -1, int height = -1)
+{
+  char header[128];
+  int headerLen = 0;
+  int channels = (format == IMAGE_RAW_RGB || format == IMAGE_PPM) ? 3 : 4;
+
+  if ((width <= 0 || height <= 0) && GetCanvasSize(&width, &height))
+    return NULL;
+
+  if (format == IMAGE_PPM)
+    headerLen = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
+  else if (format == IMAGE_PAM)
+    headerLen = snprintf(header, sizeof(header), "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+
+  Image *image = (Image *)malloc(sizeof(Image));
+  if (image == NULL)
+    return NULL;
+
+  image->channels = channels;
+  image->stride = (size_t)width * channels;
+  image->mapSize = headerLen + image->stride * height;
+
+  // A freshly truncated file reads as zeros, which is already the transparent black clear color
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    free(image);
+    return NULL;
+  }
+
+  if (ftruncate(fd, image->mapSize))
+  {
+    close(fd);
+    free(image);
+    return NULL;
+  }
+
+  image->map = mmap(NULL, image->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image->map == MAP_FAILED)
+  {
+    free(image);
+    return NULL;
+  }
+
+  memcpy(image->map, header, headerLen);
+  image->pixels = (uint8_t *)image->map + headerLen;
+  image->target.width = width;
+  image->target.height = height;
+  image->target.plot = PlotImage;
+  image->target.span = SpanImage;
+  return image;
+}
+
+// Interface to unmap a mapped image, the page cache writes it back to disk on its own unless asked to sync
+int CloseMappedImage(Image *image, int sync = 0)
+{
+  int rc = 0;
+
+  if (image == NULL)
+    return -1;
+
+  if (renderTarget == &image->target)
+    renderTarget = NULL;
+
+  if (sync && msync(image->map, image->mapSize, MS_SYNC))
+    rc = -1;
+  if (munmap(image->map, image->mapSize))
+    rc = -1;
+
+  free(image);
+  return rc;
+}
+
+// Subprocess that starts an empty coverage buffer clipped to the canvas
+int beginCoverage(CoverageBuffer *buffer)
+{
+  buffer->cells.clear();
+  buffer->points.clear();
+  buffer->minRow = INT_MAX;
+  buffer->maxRow = INT_MIN;
+  return GetCanvasSize(&buffer->width, &buffer->height);
+}
+
+// Subprocess that adds a signed area contribution, cells left of the canvas fold into column 0 as only their running sum matters there
+inline void addCoverageCell(CoverageBuffer *buffer, int x, int y, double area)
+{
+  CoverageCell cell = {y, max(x, 0), (float)area};
+
+  if (x < buffer->width)
+    buffer->cells.push_back(cell);
+}
+
+// Subprocess that accumulates the signed area left of an edge row by row the way font rasterizers do
+void addCoverageEdge(CoverageBuffer *buffer, double x0, double y0, double x1, double y1)
+{
+  double dir = 1, swap, dxdy, x, xnext, dy, d, xa, xb, xm, s, xaf, xbf, a0, a1, a2, am;
+  int y, yEnd, xai, xbi, xi, xiEnd;
+
+  if (fabs(y1 - y0) < 1e-9)
+    return;
+
+  // Edges always run downwards, upward ones subtract
+  if (y0 > y1)
+  {
+    swap = x0;
+    x0 = x1;
+    x1 = swap;
+    swap = y0;
+    y0 = y1;
+    y1 = swap;
+    dir = -1;
+  }
+
+  dxdy = (x1 - x0) / (y1 - y0);
+  x = x0;
+  y = (int)floor(y0);
+  if (y < 0)
+  {
+    x -= y0 * dxdy;
+    y = 0;
+  }
+  yEnd = min((int)ceil(y1), buffer->height);
+  if (y < yEnd)
+  {
+    buffer->minRow = min(buffer->minRow, y);
+    buffer->maxRow = max(buffer->maxRow, yEnd - 1);
+  }
+
+  for (; y < yEnd; y++)
+  {
+    dy = min(y + 1.0, y1) - max((double)y, y0);
+    xnext = x + dxdy * dy;
+    d = dy * dir;
+    xa = min(x, xnext);
+    xb = max(x, xnext);
+    xai = (int)floor(xa);
+    xbi = (int)ceil(xb);
+
+    // Edge stays within one pixel of the row, its area splits between that pixel and the next
+    if (xbi <= xai + 1)
+    {
+      xm = 0.5 * (x + xnext) - xai;
+      addCoverageCell(buffer, xai, y, d - d * xm);
+      addCoverageCell(buffer, xai + 1, y, d * xm);
+    }
+    // Edge crosses several pixels, the end pixels get triangles and the ones between equal slices
+    else
+    {
+      s = 1 / (xb - xa);
+      xaf = xa - xai;
+      a0 = 0.5 * s * (1 - xaf) * (1 - xaf);
+      xbf = xb - xbi + 1;
+      am = 0.5 * s * xbf * xbf;
+      addCoverageCell(buffer, xai, y, d * a0);
+      if (xbi == xai + 2)
+        addCoverageCell(buffer, xai + 1, y, d * (1 - a0 - am));
+      else
+      {
+        a1 = s * (1.5 - xaf);
+        addCoverageCell(buffer, xai + 1, y, d * (a1 - a0));
+        // Slices off either side of the canvas are merged or dropped instead of stored one by one
+        xi = xai + 2;
+        if (xi < 0)
+        {
+          addCoverageCell(buffer, 0, y, d * s * (min(xbi - 1, 0) - xi));
+          xi = min(xbi - 1, 0);
+        }
+        for (xiEnd = min(xbi - 1, buffer->width); xi < xiEnd; xi++)
+          addCoverageCell(buffer, xi, y, d * s);
+        a2 = a1 + (xbi - xai - 3) * s;
+        addCoverageCell(buffer, xbi - 1, y, d * (1 - a2 - am));
+      }
+      addCoverageCell(buffer, xbi, y, d * am);
+    }
+    x = xnext;
+  }
+}
+
+// Subprocess that adds a closed polygon given as count interleaved x,y pairs
+void addCoveragePolygon(CoverageBuffer *buffer, const double *xy, int count)
+{
+  for (int i = 0, j = count - 1; i < count; j = i++)
+    addCoverageEdge(buffer, xy[2 * j], xy[2 * j + 1], xy[2 * i], xy[2 * i + 1]);
+}
+
+// Subprocess that adds a line between pixel centers as a rectangle of lineWidth reaching half a pixel past both ends
+void addCoverageLine(CoverageBuffer *buffer, int x1, int y1, int x2, int y2)
+{
+  double dx = x2 - x1, dy = y2 - y1, len = hypot(dx, dy);
+  double ux = len > 0 ? dx / len : 1, uy = len > 0 ? dy / len : 0;
+  double ex = 0.5 * ux, ey = 0.5 * uy, nx = -0.5 * lineWidth * uy, ny = 0.5 * lineWidth * ux;
+
+  // Every rectangle winds the same way so overlaps at joints add up instead of cancelling
+  double quad[8] = {x1 + 0.5 - ex + nx, y1 + 0.5 - ey + ny, x2 + 0.5 + ex + nx, y2 + 0.5 + ey + ny,
+                    x2 + 0.5 + ex - nx, y2 + 0.5 + ey - ny, x1 + 0.5 - ex - nx, y1 + 0.5 - ey - ny};
+  addCoveragePolygon(buffer, quad, 4);
+}
+
+// Subprocess that appends the points of an elliptical arc between two angles in degrees, in either direction
+void appendCoverageArc(std::vector<double> *xy, double cx, double cy, double rx, double ry, double a1, double a2)
+{
+  double r = max(rx, ry), a;
+  double step = r > AA_ARC_TOLERANCE ? 2 * acos(1 - AA_ARC_TOLERANCE / r) : M_PI / 2;
+  int n = max((int)ceil(fabs(a2 - a1) * M_PI / 180 / step), 1);
+
+  for (int i = 0; i <= n; i++)
+  {
+    a = (a1 + (a2 - a1) * i / n) * M_PI / 180;
+    xy->push_back(cx + rx * cos(a));
+    xy->push_back(cy + ry * sin(a));
+  }
+}
+
+// Subprocess that orders coverage cells by row and then column
+bool compareCoverageCells(const CoverageCell &l, const CoverageCell &r)
+{
+  return l.y != r.y ? l.y < r.y : l.x < r.x;
+}
+
+// Subprocess that turns accumulated coverage into alpha, the uniform run after each cell goes out as a single span
+void fillCoverage(CoverageBuffer *buffer, color col, int alpha, int evenOdd = 0)
+{
+  std::vector<CoverageCell> &cells = buffer->sorted;
+  std::vector<int> &rowStart = buffer->rowStart;
+  size_t i, j, k, n = buffer->cells.size();
+  int x, y, end, a, row, rows = buffer->maxRow - buffer->minRow + 1;
+  float sum = 0, cover;
+  CoverageCell cell;
+  Image *image = renderTarget != NULL && renderTarget->plot == PlotImage ? (Image *)renderTarget : NULL;
+  uint8_t *px;
+
+  if (n == 0)
+    return;
+
+  // Counting sort by row, then the few cells of each row are sorted by column
+  rowStart.assign(rows + 1, 0);
+  for (i = 0; i < n; i++)
+    rowStart[buffer->cells[i].y - buffer->minRow + 1]++;
+  for (row = 0; row < rows; row++)
+    rowStart[row + 1] += rowStart[row];
+  cells.resize(n);
+  for (i = 0; i < n; i++)
+    cells[rowStart[buffer->cells[i].y - buffer->minRow]++] = buffer->cells[i];
+  for (row = 0, i = 0; row < rows; row++)
+  {
+    if (rowStart[row] - i > 32)
+      std::sort(cells.begin() + i, cells.begin() + rowStart[row], compareCoverageCells);
+    else
+      for (j = i + 1; j < (size_t)rowStart[row]; j++)
+      {
+        cell = cells[j];
+        for (k = j; k > i && cells[k - 1].x > cell.x; k--)
+          cells[k] = cells[k - 1];
+        cells[k] = cell;
+      }
+    i = rowStart[row];
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    x = cells[i].x;
+    y = cells[i].y;
+    if (i == 0 || cells[i - 1].y != y)
+      sum = 0;
+
+    // Gather every cell of the pixel
+    sum += cells[i].area;
+    while (i + 1 < n && cells[i + 1].y == y && cells[i + 1].x == x)
+      sum += cells[++i].area;
+
+    // Even-odd folds the winding like the aliased polygon fill, otherwise overlapping parts never exceed full coverage
+    cover = fabsf(sum);
+    if (evenOdd)
+    {
+      cover = fmodf(cover, 2.0f);
+      if (cover > 1)
+        cover = 2 - cover;
+    }
+    else if (cover > 1)
+      cover = 1;
+
+    end = i + 1 < n && cells[i + 1].y == y ? cells[i + 1].x : buffer->width;
+    a = (int)(cover * alpha + 0.5f);
+    if (a <= 0)
+      continue;
+
+    // Dense images are blended in place as the cells already lie on the canvas
+    if (image != NULL)
+      for (px = image->pixels + (size_t)y * image->stride + (size_t)x * image->channels; x < end; x++, px += image->channels)
+        BlendPixel(px, image->channels, col, a);
+    else
+      DrawSpan(x, y, end - x, col, a);
+  }
+}
+
+// Subprocess that maps ellipse angles to a start and end angle going clockwise, returns 1 for full ellipses
+int getCoverageAngles(int a1, int a2, double *start, double *end)
+{
+  if ((a1 < 0 && a2 < 0) || (a1 == a2))
+    return 1;
+
+  *start = max(a1, 0);
+  *end = a2 < 0 ? 360 : min(a2, 360);
+  if (*start > *end)
+    *end += 360;
+  return 0;
+}
+
+// Subprocess that draws an anti-aliased line
+void DrawAntiAliasedLine(int x1, int y1, int x2, int y2)
+{
+  CoverageBuffer *buffer = &coverageBuffer;
+  if (beginCoverage(buffer))
+    return;
+
+  addCoverageLine(buffer, x1, y1, x2, y2);
+  fillCoverage(buffer, pixelColor1, alphaChannel1);
+}
+
+// Subprocess that draws an anti-aliased polygon outline in a single pass so joints are not blended twice
+void DrawAntiAliasedPoly(TImageCoordList *coordList)
+{
+  CoverageBuffer *buffer = &coverageBuffer;
+  if (beginCoverage(buffer))
+    return;
+
+  for (TImageCoordList::iterator iter = coordList->begin(); iter + 1 < coordList->end(); iter++)
+    addCoverageLine(buffer, iter->first, iter->second, (iter + 1)->first, (iter + 1)->second);
+  fillCoverage(buffer, pixelColor1, alphaChannel1);
+}
+
+// Subprocess that draws an anti-aliased filled polygon through the pixel centers of its vertices and outlines it
+void DrawAntiAliasedFilledPoly(TImageCoordList *coordList)
+{
+  CoverageBuffer *buffer = &coverageBuffer;
+  if (beginCoverage(buffer) || coordList->size() < 3)
+    return;
+
+  for (TImageCoordList::iterator iter = coordList->begin(); iter != coordList->end(); iter++)
+  {
+    buffer->points.push_back(iter->first + 0.5);
+    buffer->points.push_back(iter->second + 0.5);
+  }
+  addCoveragePolygon(buffer, buffer->points.data(), coordList->size());
+  fillCoverage(buffer, pixelColor2, alphaChannel2, 1);
+
+  // Outline over the fill like the aliased polygon, including the closing edge
+  beginCoverage(buffer);
+  for (TImageCoordList::iterator iter = coordList->begin(); iter != coordList->end(); iter++)
+  {
+    TImageCoordList::iterator next = iter + 1 == coordList->end() ? coordList->begin() : iter + 1;
+    addCoverageLine(buffer, iter->first, iter->second, next->first, next->second);
+  }
+  fillCoverage(buffer, pixelColor1, alphaChannel1);
+}
+
+// Subprocess that draws an anti-aliased ellipse or elliptical arc as a ring of lineWidth around the radii
+void DrawAntiAliasedEllipse(int x, int y, int rx, int ry, int a1, int a2)
+{
+  CoverageBuffer *buffer = &coverageBuffer;
+  double cx = x + 0.5, cy = y + 0.5, start, end;
+  // Same split as the aliased line width, odd widths go under and even ones over
+  double outer = (lineWidth >> 1) + 0.5, inner = ((lineWidth - 1) >> 1) + 0.5;
+  if (beginCoverage(buffer))
+    return;
+
+  // Full ellipses subtract the inner outline wound the other way
+  if (getCoverageAngles(a1, a2, &start, &end))
+  {
+    appendCoverageArc(&buffer->points, cx, cy, rx + outer, ry + outer, 0, 360);
+    addCoveragePolygon(buffer, buffer->points.data(), buffer->points.size() / 2);
+    if (rx > inner && ry > inner)
+    {
+      buffer->points.clear();
+      appendCoverageArc(&buffer->points, cx, cy, rx - inner, ry - inner, 360, 0);
+      addCoveragePolygon(buffer, buffer->points.data(), buffer->points.size() / 2);
+    }
+  }
+  // Arcs go out along the outer side and back along the inner one
+  else
+  {
+    appendCoverageArc(&buffer->points, cx, cy, rx + outer, ry + outer, start, end);
+    appendCoverageArc(&buffer->points, cx, cy, max(rx - inner, 0.0), max(ry - inner, 0.0), end, start);
+    addCoveragePolygon(buffer, buffer->points.data(), buffer->points.size() / 2);
+  }
+  fillCoverage(buffer, pixelColor1, alphaChannel1);
+}
+
+// Subprocess that draws an anti-aliased pie or pie sector fill up to the radii, the outline ring goes on top
+void DrawAntiAliasedPie(int x, int y, int rx, int ry, int a1, int a2)
+{
+  CoverageBuffer *buffer = &coverageBuffer;
+  double cx = x + 0.5, cy = y + 0.5, start = 0, end = 360;
+  if (beginCoverage(buffer))
+    return;
+
+  if (!getCoverageAngles(a1, a2, &start, &end))
+  {
+    buffer->points.push_back(cx);
+    buffer->points.push_back(cy);
+  }
+  appendCoverageArc(&buffer->points, cx, cy, rx, ry, start, end);
+  addCoveragePolygon(buffer, buffer->points.data(), buffer->points.size() / 2);
+  fillCoverage(buffer, pixelColor2, alphaChannel2);
+
+  DrawAntiAliasedEllipse(x, y, rx, ry, a1, a2);
+}
+
+// Interface to start iterating the pixels of a basic 1px thick line, addition 64-bit fixed point with precalculations implementation of EFLA
+void InitLineIterator(LineIterator *it, int x1, int y1, int x2, int y2, uint32_t pattern = -1L)
+{
+  int shortLen = y2 - y1;
+  int longLen = x2 - x1;
+
+  it->yLonger = false;
+  if (abs(shortLen) > abs(longLen))
+  {
+    int swap = shortLen;
+    shortLen = longLen;
+    longLen = swap;
+    it->yLonger = true;
+  }
+
+  // Precalculation of incremental step
+  int64_t decInc = longLen == 0 ? 0 : ((int64_t)shortLen << FIXED_SHIFT) / longLen;
+
+  // Walk the longer axis in the direction of the line
+  it->pos = it->yLonger ? y1 : x1;
+  it->end = it->pos + longLen;
+  it->step = longLen > 0 ? 1 : -1;
+  it->j = FIXED_HALF + ((int64_t)(it->yLonger ? x1 : y1) << FIXED_SHIFT);
+  it->inc = longLen > 0 ? decInc : -decInc;
+  it->pattern = pattern;
+}
+
+// Interface to get the next pixel of a line, returns false once the line is exhausted
+bool NextLinePixel(LineIterator *it, int *x, int *y)
+{
+  int pixelFlag, minor;
+
+  while (it->step > 0 ? it->pos <= it->end : it->pos >= it->end)
+  {
+    pixelFlag = GetAndRotatePixelFlag(&it->pattern);
+    minor = abs((int)(it->j >> FIXED_SHIFT));
+    if (pixelFlag)
+    {
+      *x = it->yLonger ? minor : it->pos;
+      *y = it->yLonger ? it->pos : minor;
+    }
+    it->j += it->inc;
+    it->pos += it->step;
+    if (pixelFlag)
+      return true;
+  }
+
+  return false;
+}
+
+// Subprocess that draws a basic 1px thick line
+void DrawBasicLine(int x1, int y1, int x2, int y2, uint32_t pattern = -1L)
+{
+  LineIterator it;
+  int x, y;
+
+  InitLineIterator(&it, x1, y1, x2, y2, pattern);
+  while (NextLinePixel(&it, &x, &y))
+    DrawPixel(x, y, pixelColor1, alphaChannel1);
+}
+
+// Interface for drawing lines
+void DrawLine(int x1, int y1, int x2, int y2, int omitEndpoints = 0)
+{
+  if (antiAlias)
+  {
+    DrawAntiAliasedLine(x1, y1, x2, y2);
+    return;
+  }
+
+  if (omitEndpoints)
+  {
+    if (x1 > x2)
+    {
+      x1--;
+      x2++;
+    }
+    else if (x1 < x2)
+    {
+      x1++;
+      x2--;
+    }
+    if (y1 > y2)
+    {
+      y1--;
+      y2++;
+    }
+    else if (y1 < y2)
+    {
+      y1++;
+      y2--;
+    }
+  }
+
+  int dx = x2 - x1;
+  int dy = y2 - y1;
+
+  // horizontal line
+  if (dx != 0 && dy == 0)
+  {
+    // Handling line width
+    for (int i = 1; i <= lineWidth; i++)
+    {
+      // Odd goes under
+      if (i & 1)
+        DrawBasicLine(x1, y1 - ((i - 1) / 2), x2, y2 - ((i - 1) / 2), linePattern);
+      // Even goes over
+      else
+        DrawBasicLine(x1, y1 + (i / 2), x2, y2 + (i / 2), linePattern);
+    }
+  }
+  // vertical line
+  else if (dx == 0 && dy != 0)
   {
     // Handling line width
     for (int i = 1; i <= lineWidth; i++)
@@ -332,7 +1460,7 @@ void DrawBox(int x1, int y1, int x2, int y2)
   int dx2 = max(x1, x2) - widthCor;
   int dy1 = min(y1, y2) + widthCor + 1;
   int dy2 = max(y1, y2) - widthCor;
-  int pixelFlag;
+  int start;
   std::deque<uint32_t>::iterator patternIter;
   uint32_t tempPattern;
 
@@ -344,19 +1472,20 @@ void DrawBox(int x1, int y1, int x2, int y2)
     tempPattern = *patternIter;
     dx1 = min(x1, x2) + widthCor + 1;
 
-    for (; dx1 <= dx2; dx1++)
+    // Runs of set pattern bits go out as single spans
+    for (start = dx1; dx1 <= dx2; dx1++)
     {
-      pixelFlag = GetAndRotatePixelFlag(&*patternIter);
-      if (pixelFlag)
-        DrawPixel(dx1, dy1, pixelColor2, alphaChannel2);
+      if (GetAndRotatePixelFlag(&tempPattern))
+        continue;
+      if (dx1 > start)
+        DrawSpan(start, dy1, dx1 - start, pixelColor2, alphaChannel2);
+      start = dx1 + 1;
     }
+    if (dx1 > start)
+      DrawSpan(start, dy1, dx1 - start, pixelColor2, alphaChannel2);
 
-    // Reset current line of fill pattern to avoid gradual drift
-    *patternIter = tempPattern;
     // Loop fill pattern
-    if (patternIter != fillPattern.end())
-      patternIter++;
-    else
+    if (++patternIter == fillPattern.end())
       patternIter = fillPattern.begin();
   }
 
@@ -370,6 +1499,12 @@ void DrawPoly(TImageCoordList *coordList)
   int x1, y1, x2, y2;
   bool endPoints = true;
 
+  if (antiAlias)
+  {
+    DrawAntiAliasedPoly(coordList);
+    return;
+  }
+
   // Iterate through vertexes
   for (TImageCoordList::iterator iter = coordList->begin(); iter != coordList->end(); iter++)
   {
@@ -393,8 +1528,8 @@ Edge *createEdge(TImageCoordPair lower, TImageCoordPair upper, int yComp)
 {
   Edge *newEdge;
   newEdge = (Edge *)malloc(sizeof(Edge));
-  newEdge->dx = (float)lower.first;
-  newEdge->slope = (float)(upper.first - lower.first) / (upper.second - lower.second);
+  newEdge->dx = (int64_t)lower.first << FIXED_SHIFT;
+  newEdge->slope = ((int64_t)(upper.first - lower.first) << FIXED_SHIFT) / (upper.second - lower.second);
   if (upper.second < yComp)
     newEdge->yMax = upper.second - 1;
   else
@@ -414,440 +1549,3339 @@ void insertEdge(Edge **ptrHead, Edge *newEdge)
     ptrHead = &((*ptrHead)->next);
   }
 
-  newEdge->next = *ptrHead;
-  *ptrHead = newEdge;
+  newEdge->next = *ptrHead;
+  *ptrHead = newEdge;
+}
+
+// Subprocess that starts building an edge table whose rows start at yOffset, edges go to outline too if it is given
+void beginEdgeTable(EdgeTableBuilder *builder, Edge **edgeTable, int yOffset, std::vector<TImageCoordPair> *outline = NULL)
+{
+  builder->edgeTable = edgeTable;
+  builder->outline = outline;
+  builder->yOffset = yOffset;
+  builder->count = 0;
+  builder->hasPending = false;
+}
+
+// Subprocess that adds the edge from current to next, yPrev and yNext belong to the vertices either side
+void addTableEdge(EdgeTableBuilder *builder, TImageCoordPair current, TImageCoordPair next, int yPrev, int yNext)
+{
+  // Horizontal edges are only outlined, counting them would flip the fill parity along their row
+  if (current.second == next.second)
+    ;
+  else if (current.second < next.second)
+    insertEdge(&builder->edgeTable[current.second - builder->yOffset], createEdge(current, next, yNext));
+  else
+    insertEdge(&builder->edgeTable[next.second - builder->yOffset], createEdge(next, current, yPrev));
+
+  if (builder->outline != NULL)
+  {
+    builder->outline->push_back(current);
+    builder->outline->push_back(next);
+  }
+}
+
+// Subprocess that commits a vertex, the edge leading up to the previous vertex is added once its successor is known
+void commitEdgeVertex(EdgeTableBuilder *builder, TImageCoordPair vertex)
+{
+  if (builder->count == 0)
+    builder->first = vertex;
+  else if (builder->count == 1)
+    builder->second = vertex;
+  else if (builder->count == 2)
+    builder->thirdY = vertex.second;
+  // Edge from the first vertex waits for the last one to be known
+  if (builder->count >= 3)
+    addTableEdge(builder, builder->prev2, builder->prev1, builder->prev3Y, vertex.second);
+
+  builder->prev3Y = builder->prev2.second;
+  builder->prev2 = builder->prev1;
+  builder->prev1 = vertex;
+  builder->count++;
+}
+
+// Subprocess that feeds a vertex to the edge table, repeated vertices are dropped
+void addEdgeVertex(EdgeTableBuilder *builder, TImageCoordPair vertex)
+{
+  if (builder->hasPending && vertex == builder->pending)
+    return;
+
+  if (builder->hasPending)
+    commitEdgeVertex(builder, builder->pending);
+  builder->pending = vertex;
+  builder->hasPending = true;
+}
+
+// Subprocess that closes the polygon, adding the edges around its first vertex
+void closeEdgeTable(EdgeTableBuilder *builder)
+{
+  // A closing vertex equal to the first one is dropped
+  if (builder->hasPending && !(builder->count > 0 && builder->pending == builder->first))
+    commitEdgeVertex(builder, builder->pending);
+  builder->hasPending = false;
+
+  if (builder->count < 2)
+  {
+    builder->count = 0;
+    return;
+  }
+
+  if (builder->count >= 3)
+    addTableEdge(builder, builder->prev2, builder->prev1, builder->prev3Y, builder->first.second);
+  addTableEdge(builder, builder->prev1, builder->first, builder->prev2.second, builder->second.second);
+  addTableEdge(builder, builder->first, builder->second, builder->prev1.second,
+               builder->count >= 3 ? builder->thirdY : builder->first.second);
+  builder->count = 0;
+}
+
+// Subprocess that inserts to active edge list
+void insertActiveList(Edge **ptrHead, Edge **activeList)
+{
+  Edge *ptr = NULL;
+  Edge *current = *ptrHead;
+
+  while (current != NULL)
+  {
+    ptr = current->next;
+    insertEdge(activeList, current);
+    current = ptr;
+  }
+}
+
+// Subprocess that updates active edge list values with each scan line
+void updateActiveList(int scan, Edge **activeList)
+{
+  Edge *current, *next, *prev = NULL;
+
+  for (current = *activeList; current != NULL; current = next)
+  {
+    next = current->next;
+
+    if (current->yMax > scan)
+    {
+      current->dx += current->slope;
+      prev = current;
+      continue;
+    }
+
+    if (prev != NULL)
+      prev->next = next;
+    else
+      *activeList = next;
+
+    free(current);
+  }
+}
+
+// Subprocess that resorts active edge list
+void resortActiveList(Edge **activeList)
+{
+  Edge *current = *activeList, *next;
+  *activeList = NULL;
+  while (current != NULL)
+  {
+    next = current->next;
+    insertEdge(activeList, current);
+    current = next;
+  }
+}
+
+// Subprocess that frees a linked list of edges
+void freeEdgeList(Edge *head)
+{
+  Edge *next;
+
+  while (head != NULL)
+  {
+    next = head->next;
+    free(head);
+    head = next;
+  }
+}
+
+// Interface to start iterating the fill spans of a built edge table covering rows minY to maxY, rows outside firstY to lastY only step their edges
+void InitFillSpanIterator(FillSpanIterator *it, Edge **edgeTable, int minY, int maxY, int firstY = INT_MIN, int lastY = INT_MAX)
+{
+  // Fill pattern rows stay aligned to the canvas rows
+  int patternRows = fillPattern.size();
+
+  it->edgeTable = edgeTable;
+  it->activeList = NULL;
+  it->current = NULL;
+  it->minY = minY;
+  it->maxY = maxY;
+  it->firstY = firstY;
+  it->lastY = min(maxY, lastY);
+  it->scan = minY;
+  it->count = 0;
+  it->spanX = it->spanEnd = 0;
+  it->rowStarted = false;
+  it->ownsTable = false;
+  it->patternIter = fillPattern.begin() + ((minY % patternRows) + patternRows) % patternRows;
+}
+
+// Interface to start iterating the fill spans of a polygon, the iterator builds its own edge table and frees it once
+// every row is done, rows outside firstY to lastY only step their edges. Returns -1 if the table cannot be allocated
+int InitFillSpanIterator(FillSpanIterator *it, const TImageCoordList *coordList, int firstY = INT_MIN, int lastY = INT_MAX)
+{
+  EdgeTableBuilder builder;
+  Edge **edgeTable = NULL;
+  int minY = 0, maxY = -1;
+
+  if (coordList->size() >= 2)
+  {
+    minY = maxY = coordList->front().second;
+    for (TImageCoordList::const_iterator iter = coordList->begin(); iter != coordList->end(); iter++)
+    {
+      minY = min(minY, iter->second);
+      maxY = max(maxY, iter->second);
+    }
+    edgeTable = (Edge **)calloc(maxY - minY + 1, sizeof(Edge *));
+  }
+
+  // Without a table the iterator is empty
+  if (edgeTable == NULL)
+  {
+    InitFillSpanIterator(it, (Edge **)NULL, 0, -1);
+    return coordList->size() >= 2 ? -1 : 0;
+  }
+
+  beginEdgeTable(&builder, edgeTable, minY);
+  for (TImageCoordList::const_iterator iter = coordList->begin(); iter != coordList->end(); iter++)
+    addEdgeVertex(&builder, *iter);
+  closeEdgeTable(&builder);
+
+  InitFillSpanIterator(it, edgeTable, minY, maxY, firstY, lastY);
+  it->ownsTable = true;
+  return 0;
+}
+
+// Forward declaration of the iterator release, owned tables are released as soon as the walk is done
+void FreeFillSpanIterator(FillSpanIterator *it);
+
+// Interface to get the next span of pattern set pixels inside the polygon, returns false once every row is done
+bool NextFillSpan(FillSpanIterator *it, int *x, int *y, int *length)
+{
+  int start, end, off;
+  Edge *next;
+
+  for (;;)
+  {
+    // Continue the span between the current pair of edges
+    start = end = it->spanX;
+    while (it->spanX < it->spanEnd)
+    {
+      if (GetAndRotatePixelFlag(&it->spanPattern))
+      {
+        if (start == end)
+          start = it->spanX;
+        end = ++it->spanX;
+      }
+      else
+      {
+        it->spanX++;
+        if (start != end)
+          break;
+      }
+    }
+    if (start != end)
+    {
+      *x = start;
+      *y = it->scan;
+      *length = end - start;
+      return true;
+    }
+
+    // Edges are shortened at monotonic vertices, so plain even-odd counting gives the inside spans
+    if (it->current != NULL && it->current->next != NULL)
+    {
+      next = it->current->next;
+      it->count++;
+
+      it->spanPattern = it->rowPattern;
+      for (off = 0; off < (int)(it->current->dx >> FIXED_SHIFT) % 32; off++)
+        GetAndRotatePixelFlag(&it->spanPattern);
+      if (it->count & 1)
+      {
+        it->spanX = (int)(it->current->dx >> FIXED_SHIFT) + (lineWidth >> 2) + 1;
+        it->spanEnd = (int)(next->dx >> FIXED_SHIFT) - ((lineWidth - 1) >> 2) + 1;
+      }
+      it->current = next;
+      continue;
+    }
+
+    // Step the edges past the finished row
+    if (it->rowStarted)
+    {
+      updateActiveList(it->scan, &it->activeList);
+      resortActiveList(&it->activeList);
+      // Loop fill pattern
+      if (++it->patternIter == fillPattern.end())
+        it->patternIter = fillPattern.begin();
+      it->scan++;
+      it->rowStarted = false;
+    }
+
+    if (it->scan > it->lastY)
+    {
+      if (it->ownsTable)
+        FreeFillSpanIterator(it);
+      return false;
+    }
+
+    insertActiveList(&it->edgeTable[it->scan - it->minY], &it->activeList);
+    it->edgeTable[it->scan - it->minY] = NULL;
+    it->rowPattern = *it->patternIter;
+    it->count = 0;
+    it->current = it->scan >= it->firstY ? it->activeList : NULL;
+    it->rowStarted = true;
+  }
+}
+
+// Interface to free whatever edges a fill span iterator has not passed yet, and its table if it built one, needed when
+// stopping early or clipping rows
+void FreeFillSpanIterator(FillSpanIterator *it)
+{
+  for (int i = it->scan - it->minY; it->edgeTable != NULL && i <= it->maxY - it->minY; i++)
+  {
+    freeEdgeList(it->edgeTable[i]);
+    it->edgeTable[i] = NULL;
+  }
+  freeEdgeList(it->activeList);
+  it->activeList = it->current = NULL;
+
+  if (it->ownsTable)
+  {
+    free(it->edgeTable);
+    it->edgeTable = NULL;
+    it->ownsTable = false;
+  }
+}
+
+// Subprocess that outlines a built edge table with the edges collected while building it, then scan-fills it and frees its edges.
+// Horizontal edges are not in the table, so the pixels they cover are cut out of the fill to leave their outline on top
+void scanEdgeTable(Edge **edgeTable, int minY, int maxY, std::vector<TImageCoordPair> *outline)
+{
+  int x, y, length, end, canvasX, canvasY;
+  FillSpanIterator it;
+  std::vector<std::pair<int, TImageCoordPair> > flats;
+  size_t i, flat = 0;
+  if (GetCanvasSize(&canvasX, &canvasY))
+    canvasY = maxY + 1;
+
+  for (i = 0; i + 1 < outline->size(); i += 2)
+  {
+    DrawLine((*outline)[i].first, (*outline)[i].second, (*outline)[i + 1].first, (*outline)[i + 1].second);
+    if ((*outline)[i].second == (*outline)[i + 1].second)
+      flats.push_back(std::make_pair((*outline)[i].second, std::make_pair(min((*outline)[i].first, (*outline)[i + 1].first),
+                                                                          max((*outline)[i].first, (*outline)[i + 1].first))));
+  }
+  std::sort(flats.begin(), flats.end());
+
+  // Rows above the canvas only step their edges and rows below it are never walked
+  InitFillSpanIterator(&it, edgeTable, minY, maxY, 0, canvasY - 1);
+  while (NextFillSpan(&it, &x, &y, &length))
+  {
+    // Spans come row by row from left to right, so the horizontal edges of a row are passed in order too
+    while (flat < flats.size() && flats[flat].first < y)
+      flat++;
+    end = x + length;
+    for (i = flat; i < flats.size() && flats[i].first == y && x < end; i++)
+    {
+      if (flats[i].second.second < x || flats[i].second.first >= end)
+        continue;
+      if (flats[i].second.first > x)
+        DrawSpan(x, y, flats[i].second.first - x, pixelColor2, alphaChannel2);
+      x = flats[i].second.second + 1;
+    }
+    if (x < end)
+      DrawSpan(x, y, end - x, pixelColor2, alphaChannel2);
+  }
+  FreeFillSpanIterator(&it);
+}
+
+// Interface to draw filled closed polygons
+void DrawFilledPoly(TImageCoordList *coordList)
+{
+  int minY, maxY, canvasX, canvasY;
+  EdgeTableBuilder builder;
+  std::vector<TImageCoordPair> outline;
+  if (antiAlias)
+  {
+    DrawAntiAliasedFilledPoly(coordList);
+    return;
+  }
+  if (GetCanvasSize(&canvasX, &canvasY) || coordList->size() < 2)
+    return;
+
+  // Edge table only spans the rows the polygon covers so memory scales with the polygon, not the canvas
+  minY = maxY = coordList->front().second;
+  for (TImageCoordList::iterator iter = coordList->begin(); iter != coordList->end(); iter++)
+  {
+    minY = min(minY, iter->second);
+    maxY = max(maxY, iter->second);
+  }
+
+  Edge **edgeTable = (Edge **)calloc(maxY - minY + 1, sizeof(Edge *));
+  if (edgeTable == NULL)
+    return;
+
+  beginEdgeTable(&builder, edgeTable, minY, &outline);
+  for (TImageCoordList::iterator iter = coordList->begin(); iter != coordList->end(); iter++)
+    addEdgeVertex(&builder, *iter);
+  closeEdgeTable(&builder);
+
+  scanEdgeTable(edgeTable, minY, maxY, &outline);
+  free(edgeTable);
+}
+
+// Subprocess that passes a flattened vertex on, outlines alternate endpoint omission like DrawPoly
+void emitPathVertex(PathSink *sink, double x, double y)
+{
+  TImageCoordPair vertex = std::make_pair((int)floor(x + 0.5), (int)floor(y + 0.5));
+
+  if (sink->builder != NULL)
+  {
+    addEdgeVertex(sink->builder, vertex);
+    return;
+  }
+
+  if (sink->started && vertex != sink->last)
+  {
+    DrawLine(sink->last.first, sink->last.second, vertex.first, vertex.second, sink->endPoints);
+    sink->endPoints = !sink->endPoints;
+  }
+  sink->last = vertex;
+  sink->started = true;
+}
+
+// Subprocess that adaptively flattens a quadratic curve, splitting until it is within curveTolerance of its chord
+void flattenQuad(PathSink *sink, double x0, double y0, double x1, double y1, double x2, double y2, int depth)
+{
+  // The curve strays at most a quarter of this second difference from its chord
+  double ddx = x0 - 2 * x1 + x2;
+  double ddy = y0 - 2 * y1 + y2;
+
+  if (depth >= 16 || ddx * ddx + ddy * ddy <= 16 * curveTolerance * curveTolerance)
+  {
+    emitPathVertex(sink, x2, y2);
+    return;
+  }
+
+  double ax = (x0 + x1) / 2, ay = (y0 + y1) / 2;
+  double bx = (x1 + x2) / 2, by = (y1 + y2) / 2;
+  double mx = (ax + bx) / 2, my = (ay + by) / 2;
+  flattenQuad(sink, x0, y0, ax, ay, mx, my, depth + 1);
+  flattenQuad(sink, mx, my, bx, by, x2, y2, depth + 1);
+}
+
+// Subprocess that adaptively flattens a cubic curve, splitting until it is within curveTolerance of its chord
+void flattenCubic(PathSink *sink, double x0, double y0, double x1, double y1, double x2, double y2, double x3, double y3, int depth)
+{
+  // Flatness bound of the cubic against its chord
+  double ux = 3 * x1 - 2 * x0 - x3, uy = 3 * y1 - 2 * y0 - y3;
+  double vx = 3 * x2 - x0 - 2 * x3, vy = 3 * y2 - y0 - 2 * y3;
+  double flatness = max(ux * ux, vx * vx) + max(uy * uy, vy * vy);
+
+  if (depth >= 16 || flatness <= 16 * curveTolerance * curveTolerance)
+  {
+    emitPathVertex(sink, x3, y3);
+    return;
+  }
+
+  double ax = (x0 + x1) / 2, ay = (y0 + y1) / 2;
+  double bx = (x1 + x2) / 2, by = (y1 + y2) / 2;
+  double cx = (x2 + x3) / 2, cy = (y2 + y3) / 2;
+  double abx = (ax + bx) / 2, aby = (ay + by) / 2;
+  double bcx = (bx + cx) / 2, bcy = (by + cy) / 2;
+  double mx = (abx + bcx) / 2, my = (aby + bcy) / 2;
+  flattenCubic(sink, x0, y0, ax, ay, abx, aby, mx, my, depth + 1);
+  flattenCubic(sink, mx, my, bcx, bcy, cx, cy, x3, y3, depth + 1);
+}
+
+// Subprocess that flattens a whole path into a sink, closing each subpath for fills
+void flattenPath(TPath *path, PathSink *sink)
+{
+  int startX = 0, startY = 0, x = 0, y = 0;
+
+  for (TPath::iterator command = path->begin(); command != path->end(); command++)
+  {
+    switch (command->verb)
+    {
+    case PATH_MOVE:
+      if (sink->builder != NULL)
+        closeEdgeTable(sink->builder);
+      sink->started = false;
+      sink->endPoints = true;
+      startX = x = command->x[0];
+      startY = y = command->y[0];
+      emitPathVertex(sink, x, y);
+      break;
+    case PATH_LINE:
+      x = command->x[0];
+      y = command->y[0];
+      emitPathVertex(sink, x, y);
+      break;
+    case PATH_QUAD:
+      flattenQuad(sink, x, y, command->x[0], command->y[0], command->x[1], command->y[1], 0);
+      x = command->x[1];
+      y = command->y[1];
+      break;
+    case PATH_CUBIC:
+      flattenCubic(sink, x, y, command->x[0], command->y[0], command->x[1], command->y[1], command->x[2], command->y[2], 0);
+      x = command->x[2];
+      y = command->y[2];
+      break;
+    case PATH_CLOSE:
+      x = startX;
+      y = startY;
+      if (sink->builder != NULL)
+        closeEdgeTable(sink->builder);
+      // Drawing carries on from the start of the closed subpath
+      emitPathVertex(sink, x, y);
+      break;
+    }
+  }
+
+  if (sink->builder != NULL)
+    closeEdgeTable(sink->builder);
+}
+
+// Subprocess that appends a command to a path
+void appendPathCommand(TPath *path, PathVerb verb, int x0 = 0, int y0 = 0, int x1 = 0, int y1 = 0, int x2 = 0, int y2 = 0)
+{
+  PathCommand command = {verb, {x0, x1, x2}, {y0, y1, y2}};
+  path->push_back(command);
+}
+
+// Interfaces to build paths
+void PathMoveTo(TPath *path, int x, int y)
+{
+  appendPathCommand(path, PATH_MOVE, x, y);
+}
+
+void PathLineTo(TPath *path, int x, int y)
+{
+  appendPathCommand(path, PATH_LINE, x, y);
+}
+
+void PathQuadTo(TPath *path, int cx, int cy, int x, int y)
+{
+  appendPathCommand(path, PATH_QUAD, cx, cy, x, y);
+}
+
+void PathCubicTo(TPath *path, int c1x, int c1y, int c2x, int c2y, int x, int y)
+{
+  appendPathCommand(path, PATH_CUBIC, c1x, c1y, c2x, c2y, x, y);
+}
+
+void PathClose(TPath *path)
+{
+  appendPathCommand(path, PATH_CLOSE);
+}
+
+// Interface to draw the outline of a path
+void DrawPath(TPath *path)
+{
+  PathSink sink = {NULL, false, true, std::make_pair(0, 0)};
+  flattenPath(path, &sink);
+}
+
+// Interface to draw a filled path, every subpath is closed and filled even-odd through the DrawFilledPoly edge logic
+void DrawFilledPath(TPath *path)
+{
+  int minY = 0, maxY = -1, canvasX, canvasY;
+  EdgeTableBuilder builder;
+  std::vector<TImageCoordPair> outline;
+  if (GetCanvasSize(&canvasX, &canvasY))
+    return;
+
+  // Curves stay within the hull of their control points, so those bound the edge table
+  for (TPath::iterator command = path->begin(); command != path->end(); command++)
+  {
+    int points = command->verb == PATH_CLOSE ? 0 : (command->verb == PATH_QUAD ? 2 : (command->verb == PATH_CUBIC ? 3 : 1));
+    for (int i = 0; i < points; i++)
+    {
+      if (maxY < minY)
+        minY = maxY = command->y[i];
+      minY = min(minY, command->y[i]);
+      maxY = max(maxY, command->y[i]);
+    }
+  }
+  if (maxY < minY)
+    return;
+
+  Edge **edgeTable = (Edge **)calloc(maxY - minY + 1, sizeof(Edge *));
+  if (edgeTable == NULL)
+    return;
+
+  beginEdgeTable(&builder, edgeTable, minY, &outline);
+  PathSink sink = {&builder, false, true, std::make_pair(0, 0)};
+  flattenPath(path, &sink);
+
+  scanEdgeTable(edgeTable, minY, maxY, &outline);
+  free(edgeTable);
+}
+
+// Interface to draw a quadratic bezier curve
+void DrawBezier(int x0, int y0, int cx, int cy, int x1, int y1)
+{
+  PathSink sink = {NULL, false, true, std::make_pair(0, 0)};
+  emitPathVertex(&sink, x0, y0);
+  flattenQuad(&sink, x0, y0, cx, cy, x1, y1, 0);
+}
+
+// Interface to draw a cubic bezier curve
+void DrawBezier(int x0, int y0, int c1x, int c1y, int c2x, int c2y, int x1, int y1)
+{
+  PathSink sink = {NULL, false, true, std::make_pair(0, 0)};
+  emitPathVertex(&sink, x0, y0);
+  flattenCubic(&sink, x0, y0, c1x, c1y, c2x, c2y, x1, y1, 0);
+}
+
+// Interface to start iterating the pixels of a basic 1px thick full ellipse using midpoint algorithm
+void InitEllipseIterator(EllipseIterator *it, int x, int y, int rx, int ry, uint32_t pattern = linePattern)
+{
+  // Steps grow with the cube of the radii, so they are computed in 64 bits for big ellipses
+  long long a = 2 * (long long)rx;
+  long long b = 2 * (long long)ry;
+  long long b1 = b & 1;
+
+  it->dx = 4 * (1 - a) * b * b;
+  it->dy = 4 * (b1 + 1) * a * a;
+  it->err = it->dx + it->dy + b1 * a * a;
+  it->x0 = x - rx;
+  it->y0 = y - ry + (b + 1) / 2;
+  it->x1 = x + rx;
+  it->y1 = it->y0;
+  it->b = (int)b;
+  it->a8 = 8 * a * a;
+  it->b8 = 8 * b * b;
+  it->phase = 0;
+  it->next = it->count = 0;
+  it->pattern = pattern;
+}
+
+// Subprocess that queues the four mirrored pixels of an ellipse step
+void queueEllipseStep(EllipseIterator *it, int left, int right)
+{
+  it->px[0] = right;
+  it->py[0] = it->y0;
+  it->px[1] = left;
+  it->py[1] = it->y0;
+  it->px[2] = left;
+  it->py[2] = it->y1;
+  it->px[3] = right;
+  it->py[3] = it->y1;
+  it->count = 4;
+}
+
+// Interface to get the next pixel of an ellipse, returns false once the ellipse is exhausted
+bool NextEllipsePixel(EllipseIterator *it, int *x, int *y)
+{
+  long long err2;
+
+  while (it->next >= it->count)
+  {
+    it->next = it->count = 0;
+
+    // Midpoint steps until the left and right sides meet
+    if (it->phase == 0)
+    {
+      if (GetAndRotatePixelFlag(&it->pattern))
+        queueEllipseStep(it, it->x0, it->x1);
+      err2 = 2 * it->err;
+      if (err2 <= it->dy)
+      {
+        it->y0++;
+        it->y1--;
+        it->dy += it->a8;
+        it->err += it->dy;
+      }
+      if (err2 >= it->dx || 2 * it->err > it->dy)
+      {
+        it->x0++;
+        it->x1--;
+        it->dx += it->b8;
+        it->err += it->dx;
+      }
+      if (it->x0 > it->x1)
+        it->phase = 1;
+    }
+    // Finish the tips of flat ellipses
+    else if (it->phase == 1 && it->y0 - it->y1 < it->b)
+    {
+      if (GetAndRotatePixelFlag(&it->pattern))
+        queueEllipseStep(it, it->x0 - 1, it->x1 + 1);
+      it->y0++;
+      it->y1--;
+    }
+    else
+    {
+      it->phase = 2;
+      return false;
+    }
+  }
+
+  *x = it->px[it->next];
+  *y = it->py[it->next];
+  it->next++;
+  return true;
+}
+
+// Subprocess that draws a basic 1px thick full ellipse
+void DrawBasicEllipse(int x, int y, int rx, int ry)
+{
+  EllipseIterator it;
+  int px, py;
+
+  InitEllipseIterator(&it, x, y, rx, ry);
+  while (NextEllipsePixel(&it, &px, &py))
+    DrawPixel(px, py, pixelColor1, alphaChannel1);
+}
+
+// Subprocess that draws a basic 1px thick elliptical arc using slower trigonometric algorithm in the clockwise direction
+void DrawPartialEllipse(int x, int y, int rx, int ry, int a1, int a2)
+{
+  int dx, dy, lx, ly, a;
+  int pixelFlag;
+  uint32_t pattern = linePattern;
+
+  lx = rx * cos(a1 * M_PI / 180);
+  ly = ry * sin(a1 * M_PI / 180);
+
+  for (a = a1 + 1; a <= a2; a++)
+  {
+    dx = rx * cos(a * M_PI / 180.00);
+    dy = ry * sin(a * M_PI / 180.00);
+    pixelFlag = GetAndRotatePixelFlag(&pattern);
+    if (pixelFlag)
+      DrawBasicLine(x + lx, y + ly, x + dx, y + dy);
+    lx = dx;
+    ly = dy;
+  }
+}
+
+// Subprocess that draws the outline arcs of full ellipses and ellipse sectors without radius lines
+void DrawEllipseArcs(int x, int y, int rx, int ry, int a1, int a2)
+{
+  // Handling for full ellipse
+  if ((a1 < 0 && a2 < 0) || (a1 == a2))
+  {
+    // Handling line width
+    for (int i = 1; i <= lineWidth; i++)
+    {
+      // Odd goes under
+      if (i & 1)
+        DrawBasicEllipse(x, y, rx - ((i - 1) >> 1), ry - ((i - 1) >> 1));
+      // Even goes over
+      else
+        DrawBasicEllipse(x, y, rx + (i >> 1), ry + (i >> 1));
+    }
+  }
+  else
+  // Handling for elliptical arcs and sectors
+  {
+    int ta1 = max(a1, 0);
+    int ta2 = min(a2, 360);
+    int ta3 = 0;
+
+    // Break down into 2 arcs if a1 > a2 to preserve directionality
+    if (ta1 > ta2)
+    {
+      ta3 = ta1;
+      ta1 = 0;
+    }
+
+    // Handling line width
+    for (int i = 1; i <= lineWidth; i++)
+    {
+      // Odd goes under
+      if (i & 1)
+        DrawPartialEllipse(x, y, rx - ((i - 1) >> 1), ry - ((i - 1) >> 1), ta1, ta2);
+      // Even goes over
+      else
+        DrawPartialEllipse(x, y, rx + (i >> 1), ry + (i >> 1), ta1, ta2);
+    }
+
+    // Draw second part of arc if it loops past start
+    if (ta3)
+    {
+      // Handling line width
+      for (int i = 1; i <= lineWidth; i++)
+      {
+        // Odd goes under
+        if (i & 1)
+          DrawPartialEllipse(x, y, rx - ((i - 1) >> 1), ry - ((i - 1) >> 1), ta3, 360);
+        // Even goes over
+        else
+          DrawPartialEllipse(x, y, rx + (i >> 1), ry + (i >> 1), ta3, 360);
+      }
+    }
+  }
+}
+
+// Subprocess that draws radius lines to close an ellipse sector, full ellipses have none
+void DrawEllipseRadii(int x, int y, int rx, int ry, int a1, int a2)
+{
+  if ((a1 < 0 && a2 < 0) || (a1 == a2))
+    return;
+
+  DrawLine(x, y, x + cos(a1 * M_PI / 180) * rx, y + sin(a1 * M_PI / 180) * ry);
+  DrawLine(x, y, x + cos(a2 * M_PI / 180) * rx, y + sin(a2 * M_PI / 180) * ry);
+}
+
+// Forward declaration of the stamp cache drawing path
+void StampShape(StampKind kind, int x, int y, int rx, int ry, int a1, int a2);
+
+// Interface to draw empty full ellipses and ellipse sectors in the clockwise direction
+void DrawEllipse(int x, int y, int rx, int ry, int a1 = -1, int a2 = -1, int radii = 0)
+{
+  if (antiAlias)
+    DrawAntiAliasedEllipse(x, y, rx, ry, a1, a2);
+  else if (stampCacheLimit > 0)
+    StampShape(STAMP_ELLIPSE, x, y, rx, ry, a1, a2);
+  else
+    DrawEllipseArcs(x, y, rx, ry, a1, a2);
+
+  // Radius lines are drawn live as their rounding depends on the center
+  if (radii)
+    DrawEllipseRadii(x, y, rx, ry, a1, a2);
+}
+
+// Interface to start iterating the spans of a filled ellipse or ellipse sector, the fill pattern must not change while iterating
+void InitPieIterator(PieIterator *it, int x, int y, int rx, int ry, int a1, int a2)
+{
+  double ra1 = a1 * M_PI / 180;
+  double ra2 = a2 * M_PI / 180;
+
+  it->x = x;
+  it->y = y;
+  it->rx = rx;
+  it->ry = ry;
+  // Squared radii terms reach twice rx² * ry², unsigned 64 bits holds them up to radii of about 54000
+  it->rx2 = (long long)rx * rx;
+  it->ry2 = (long long)ry * ry;
+  it->rxry = it->rx2 * it->ry2;
+  it->a1x = rx * cos(ra1);
+  it->a1y = ry * sin(ra1);
+  it->a2x = rx * cos(ra2);
+  it->a2y = ry * sin(ra2);
+  // Sectors of 180° and wider are the union of both half planes, smaller ones their intersection
+  it->reflex = a2 - a1 >= 180;
+  it->scanx = -rx;
+  it->scany = -ry;
+  it->patternIter = fillPattern.begin();
+  it->rowPattern = *it->patternIter;
+}
+
+// Interface to get the next span of a filled ellipse or sector, returns false once every row is done
+bool NextPieSpan(PieIterator *it, int *x, int *y, int *length)
+{
+  int scanx, start, end;
+  bool inside, side1, side2;
+  long long yy;
+  unsigned long long p;
+
+  while (it->scany <= it->ry)
+  {
+    yy = (long long)it->scany * it->scany;
+    start = end = it->scanx;
+    while (it->scanx <= it->rx)
+    {
+      scanx = it->scanx++;
+      inside = GetAndRotatePixelFlag(&it->rowPattern);
+      p = (unsigned long long)((long long)scanx * scanx * it->ry2) + (unsigned long long)(yy * it->rx2);
+      if (inside && p < it->rxry)
+      {
+        side1 = (long long)scanx * it->a1y - (long long)it->scany * it->a1x <= 0;
+        side2 = (long long)scanx * it->a2y - (long long)it->scany * it->a2x > 0;
+        inside = it->reflex ? side1 || side2 : side1 && side2;
+      }
+      else
+        inside = false;
+
+      if (inside)
+      {
+        if (start == end)
+          start = scanx;
+        end = scanx + 1;
+      }
+      else if (start != end)
+        break;
+    }
+    if (start != end)
+    {
+      *x = it->x + start;
+      *y = it->y + it->scany;
+      *length = end - start;
+      return true;
+    }
+
+    // Loop fill pattern, each row starts from a fresh copy to avoid gradual drift
+    if (++it->patternIter == fillPattern.end())
+      it->patternIter = fillPattern.begin();
+    it->rowPattern = *it->patternIter;
+    it->scanx = -it->rx;
+    it->scany++;
+  }
+
+  return false;
+}
+
+// Subprocess that draws a filled ellipse or ellipse sector
+void DrawBasicPie(int x, int y, int rx, int ry, int a1, int a2)
+{
+  PieIterator it;
+  int sx, sy, length;
+
+  InitPieIterator(&it, x, y, rx, ry, a1, a2);
+  while (NextPieSpan(&it, &sx, &sy, &length))
+    DrawSpan(sx, sy, length, pixelColor2, alphaChannel2);
+}
+
+// Subprocess that draws the fill and outline arcs of a pie without its radius lines
+void DrawPieBody(int x, int y, int rx, int ry, int a1, int a2)
+{
+  // Correction for width of line
+  int widthCor = (lineWidth >> 1);
+  int ta1 = max(a1, 0);
+  int ta2 = a2 < 0 ? 360 : min(a2, 360);
+  int ta3 = 0;
+
+  // Break down into 2 sectors if a1 > a2 to preserve directionality
+  if (ta1 > ta2)
+  {
+    ta3 = ta1;
+    ta1 = 0;
+  }
+
+  DrawBasicPie(x, y, rx - widthCor, ry - widthCor, ta1, ta2);
+
+  // Draw second part of arc if it loops past start
+  if (ta3)
+    DrawBasicPie(x, y, rx - widthCor, ry - widthCor, ta3, 360);
+
+  // Draw outline of pie
+  DrawEllipseArcs(x, y, rx, ry, a1, a2);
+}
+
+// Subprocess that records pixels into stamp runs instead of drawing them, extending the last run where possible
+void PlotStampRecorder(RenderTarget *target, int x, int y, color col, int alpha)
+{
+  StampRecorder *recorder = (StampRecorder *)target;
+  std::vector<StampRun> *runs = recorder->runs;
+
+  x -= recorder->originX;
+  y -= recorder->originY;
+
+  if (!runs->empty())
+  {
+    StampRun *last = &runs->back();
+    if (last->y == y && last->x + last->length == x && last->alpha == alpha &&
+        last->col.red == col.red && last->col.green == col.green && last->col.blue == col.blue)
+    {
+      last->length++;
+      return;
+    }
+  }
+
+  StampRun run = {x, y, 1, col, alpha};
+  runs->push_back(run);
+}
+
+// Subprocess that records a horizontal run as a single stamp run, extending the last run where possible
+void SpanStampRecorder(RenderTarget *target, int x, int y, int length, color col, int alpha)
+{
+  StampRecorder *recorder = (StampRecorder *)target;
+
+  if (length <= 0)
+    return;
+
+  PlotStampRecorder(target, x, y, col, alpha);
+  recorder->runs->back().length += length - 1;
+}
+
+// Interface to resize the stamp cache, evicting least recently used stamps until it fits
+void SetStampCacheLimit(size_t bytes)
+{
+  stampCacheLimit = bytes;
+  while (stampCacheBytes > stampCacheLimit)
+  {
+    stampCacheBytes -= stampCache.back().bytes;
+    stampCacheIndex.erase(stampCache.back().key);
+    stampCache.pop_back();
+  }
+}
+
+// Subprocess that draws an ellipse or pie body from the stamp cache, rasterizing and caching it on a miss
+void StampShape(StampKind kind, int x, int y, int rx, int ry, int a1, int a2)
+{
+  // Outline pixels left or above the canvas origin are mirrored by the line stepping, so such shapes depend on their
+  // center and are drawn directly
+  if (x - rx - lineWidth < 0 || y - ry - lineWidth < 0)
+  {
+    if (kind == STAMP_PIE)
+      DrawPieBody(x, y, rx, ry, a1, a2);
+    else
+      DrawEllipseArcs(x, y, rx, ry, a1, a2);
+    return;
+  }
+
+  // Key covers the shape and every piece of state that changes its pixels
+  int params[] = {kind, rx, ry, a1, a2, lineWidth, (int)linePattern, alphaChannel1, alphaChannel2,
+                  pixelColor1.red, pixelColor1.green, pixelColor1.blue, pixelColor2.red, pixelColor2.green, pixelColor2.blue};
+  std::string key((const char *)params, sizeof(params));
+  if (kind == STAMP_PIE)
+    for (std::deque<uint32_t>::iterator iter = fillPattern.begin(); iter != fillPattern.end(); iter++)
+      key.append((const char *)&*iter, sizeof(uint32_t));
+
+  std::unordered_map<std::string, std::list<StampEntry>::iterator>::iterator found = stampCacheIndex.find(key);
+  std::vector<StampRun> *runs;
+  StampEntry entry;
+
+  if (found != stampCacheIndex.end())
+  {
+    stampCacheHits++;
+    // Move to the front of the LRU list
+    stampCache.splice(stampCache.begin(), stampCache, found->second);
+    runs = &found->second->runs;
+  }
+  else
+  {
+    stampCacheMisses++;
+
+    RenderTarget *boundTarget = renderTarget;
+    StampRecorder recorder = {{0, 0, PlotStampRecorder, SpanStampRecorder}, x, y, &entry.runs};
+    renderTarget = &recorder.target;
+    if (kind == STAMP_PIE)
+      DrawPieBody(x, y, rx, ry, a1, a2);
+    else
+      DrawEllipseArcs(x, y, rx, ry, a1, a2);
+    renderTarget = boundTarget;
+
+    entry.key = key;
+    entry.bytes = sizeof(StampEntry) + key.size() + entry.runs.capacity() * sizeof(StampRun);
+    runs = &entry.runs;
+  }
+
+  // Stamp runs at the new center
+  for (std::vector<StampRun>::iterator run = runs->begin(); run != runs->end(); run++)
+    DrawSpan(x + run->x, y + run->y, run->length, run->col, run->alpha);
+
+  // Stamps too big for the cache are drawn but not kept
+  if (found == stampCacheIndex.end() && entry.bytes <= stampCacheLimit)
+  {
+    stampCacheBytes += entry.bytes;
+    stampCache.push_front(entry);
+    stampCacheIndex[key] = stampCache.begin();
+    SetStampCacheLimit(stampCacheLimit);
+  }
+}
+
+// Interface to drop every cached stamp and reset the counters
+void ClearStampCache()
+{
+  stampCache.clear();
+  stampCacheIndex.clear();
+  stampCacheBytes = 0;
+  stampCacheHits = stampCacheMisses = 0;
+}
+
+// Interface for pies and pie sectors
+void DrawPie(int x, int y, int rx, int ry, int a1 = -1, int a2 = -1)
+{
+  if (antiAlias)
+    DrawAntiAliasedPie(x, y, rx, ry, a1, a2);
+  else if (stampCacheLimit > 0)
+    StampShape(STAMP_PIE, x, y, rx, ry, a1, a2);
+  else
+    DrawPieBody(x, y, rx, ry, a1, a2);
+
+  // Radius lines are drawn live as their rounding depends on the center
+  DrawEllipseRadii(x, y, rx, ry, a1, a2);
+}
+
+// Subprocess that builds the rows of a marker, squares are size wide and circles have radius size
+void BuildMarkerRows(MarkerShape shape, int size, std::vector<MarkerRow> *rows)
+{
+  MarkerRow row;
+
+  if (shape == MARKER_SQUARE && size > 1)
+  {
+    for (row.dy = -(size >> 1); row.dy < size - (size >> 1); row.dy++)
+    {
+      row.dx = -(size >> 1);
+      row.length = size;
+      rows->push_back(row);
+    }
+  }
+  else if (shape == MARKER_CIRCLE && size > 0)
+  {
+    // Same strict inside test as DrawBasicPie
+    for (row.dy = -size; row.dy <= size; row.dy++)
+    {
+      int half = sqrt((double)(size * size - row.dy * row.dy));
+      if (half * half + row.dy * row.dy == size * size)
+        half--;
+      if (half < 0)
+        continue;
+      row.dx = -half;
+      row.length = 2 * half + 1;
+      rows->push_back(row);
+    }
+  }
+  else
+  {
+    row.dy = row.dx = 0;
+    row.length = 1;
+    rows->push_back(row);
+  }
+}
+
+// Subprocess that draws the markers reaching image rows y1 to y2, only ever touching pixels inside those rows
+void DrawMarkerRows(Image *image, const int *sorted, const color *sortedColors, const size_t *bandStart,
+                    const std::vector<MarkerRow> *rows, int reach, int y1, int y2, color col, int alpha)
+{
+  int b1 = max(y1 - reach, 0) >> MARKER_BAND_SHIFT;
+  int b2 = min(y2 - 1 + reach, image->target.height - 1) >> MARKER_BAND_SHIFT;
+  int width = image->target.width;
+
+  for (size_t i = bandStart[b1]; i < bandStart[b2 + 1]; i++)
+  {
+    int px = sorted[2 * i];
+    int py = sorted[2 * i + 1];
+
+    if (sortedColors != NULL)
+      col = sortedColors[i];
+
+    for (std::vector<MarkerRow>::const_iterator row = rows->begin(); row != rows->end(); row++)
+    {
+      int y = py + row->dy;
+      if (y < y1 || y >= y2)
+        continue;
+
+      int x = max(px + row->dx, 0);
+      int x2 = min(px + row->dx + row->length, width);
+      uint8_t *pixel = image->pixels + y * image->stride + (size_t)x * image->channels;
+      for (; x < x2; x++, pixel += image->channels)
+        BlendPixel(pixel, image->channels, col, alpha);
+    }
+  }
+}
+
+// Interface to draw many markers of one shape in a single pass, points are interleaved x, y pairs and colors are optional
+void DrawMarkers(const int *points, size_t count, MarkerShape shape = MARKER_PIXEL, int size = 1, const color *colors = NULL)
+{
+  std::vector<MarkerRow> rows;
+  int reach = 0;
+
+  BuildMarkerRows(shape, size, &rows);
+  for (std::vector<MarkerRow>::iterator row = rows.begin(); row != rows.end(); row++)
+    reach = max(reach, abs(row->dy));
+
+  // Targets without direct pixel access draw marker by marker in submission order
+  if (renderTarget == NULL || renderTarget->plot != PlotImage)
+  {
+    for (size_t i = 0; i < count; i++)
+      for (std::vector<MarkerRow>::iterator row = rows.begin(); row != rows.end(); row++)
+        DrawSpan(points[2 * i] + row->dx, points[2 * i + 1] + row->dy, row->length,
+                 colors == NULL ? pixelColor1 : colors[i], alphaChannel1);
+    return;
+  }
+
+  Image *image = (Image *)renderTarget;
+  int height = image->target.height;
+  int bands = ((height - 1) >> MARKER_BAND_SHIFT) + 1;
+  std::vector<size_t> bandStart(bands + 1, 0);
+
+  // Counting sort of markers into row bands, stable so markers within a band keep submission order
+  for (size_t i = 0; i < count; i++)
+  {
+    int y = points[2 * i + 1];
+    if (y >= -reach && y < height + reach)
+      bandStart[(min(max(y, 0), height - 1) >> MARKER_BAND_SHIFT) + 1]++;
+  }
+  for (int b = 0; b < bands; b++)
+    bandStart[b + 1] += bandStart[b];
+
+  size_t total = bandStart[bands];
+  if (total == 0)
+    return;
+
+  // Positions and colors are copied in band order so drawing reads them sequentially
+  int *sorted = (int *)malloc(sizeof(int) * 2 * total);
+  color *sortedColors = colors == NULL ? NULL : (color *)malloc(sizeof(color) * total);
+  if (sorted == NULL || (colors != NULL && sortedColors == NULL))
+  {
+    free(sorted);
+    free(sortedColors);
+    return;
+  }
+
+  std::vector<size_t> bandFill(bandStart.begin(), bandStart.end() - 1);
+  for (size_t i = 0; i < count; i++)
+  {
+    int y = points[2 * i + 1];
+    if (y < -reach || y >= height + reach)
+      continue;
+
+    size_t slot = bandFill[min(max(y, 0), height - 1) >> MARKER_BAND_SHIFT]++;
+    sorted[2 * slot] = points[2 * i];
+    sorted[2 * slot + 1] = y;
+    if (colors != NULL)
+      sortedColors[slot] = colors[i];
+  }
+
+  // Split rows between threads so each gets a similar number of markers and owns its rows outright
+  int threads = markerThreads > 0 ? markerThreads : (int)std::thread::hardware_concurrency();
+  threads = max(1, min(threads, min(bands, (int)(total >> 16) + 1)));
+
+  std::vector<std::thread> workers;
+  int y1 = 0;
+  for (int t = 1, b = 0; t <= threads; t++)
+  {
+    size_t share = total * t / threads;
+    while (b < bands && (bandStart[b + 1] <= share || t == threads))
+      b++;
+    int y2 = t == threads ? height : min(b << MARKER_BAND_SHIFT, height);
+
+    if (t == threads)
+      DrawMarkerRows(image, sorted, sortedColors, &bandStart[0], &rows, reach, y1, y2, pixelColor1, alphaChannel1);
+    else if (y2 > y1)
+      workers.push_back(std::thread(DrawMarkerRows, image, sorted, sortedColors, &bandStart[0], &rows, reach, y1, y2,
+                                    pixelColor1, alphaChannel1));
+    y1 = max(y1, y2);
+  }
+
+  for (std::vector<std::thread>::iterator worker = workers.begin(); worker != workers.end(); worker++)
+    worker->join();
+
+  free(sorted);
+  free(sortedColors);
+}
+
+// Subprocess that captures the current drawing state
+void CaptureDrawState(DrawState *state)
+{
+  state->lineWidth = lineWidth;
+  state->linePattern = linePattern;
+  state->fillPattern = fillPattern;
+  state->pixelColor1 = pixelColor1;
+  state->pixelColor2 = pixelColor2;
+  state->alphaChannel1 = alphaChannel1;
+  state->alphaChannel2 = alphaChannel2;
+  state->antiAlias = antiAlias;
+}
+
+// Subprocess that makes a captured drawing state current
+void ApplyDrawState(const DrawState *state)
+{
+  lineWidth = state->lineWidth;
+  linePattern = state->linePattern;
+  fillPattern = state->fillPattern;
+  pixelColor1 = state->pixelColor1;
+  pixelColor2 = state->pixelColor2;
+  alphaChannel1 = state->alphaChannel1;
+  alphaChannel2 = state->alphaChannel2;
+  antiAlias = state->antiAlias;
+}
+
+// Subprocess that draws a retained shape with whatever state is current
+void DrawSceneShape(SceneShape *shape)
+{
+  switch (shape->kind)
+  {
+  case SHAPE_LINE:
+    DrawLine(shape->x1, shape->y1, shape->x2, shape->y2, shape->flag);
+    break;
+  case SHAPE_RECT:
+    DrawRect(shape->x1, shape->y1, shape->x2, shape->y2);
+    break;
+  case SHAPE_BOX:
+    DrawBox(shape->x1, shape->y1, shape->x2, shape->y2);
+    break;
+  case SHAPE_POLY:
+    DrawPoly(&shape->coords);
+    break;
+  case SHAPE_FILLED_POLY:
+    DrawFilledPoly(&shape->coords);
+    break;
+  case SHAPE_ELLIPSE:
+    DrawEllipse(shape->x1, shape->y1, shape->x2, shape->y2, shape->a1, shape->a2, shape->flag);
+    break;
+  case SHAPE_PIE:
+    DrawPie(shape->x1, shape->y1, shape->x2, shape->y2, shape->a1, shape->a2);
+    break;
+  }
+}
+
+// Subprocess that computes the pixel bounds a retained shape can touch
+void GetShapeBounds(SceneShape *shape, SceneNode *node)
+{
+  int pad = (shape->state.lineWidth >> 1) + 2;
+
+  if (shape->kind == SHAPE_ELLIPSE || shape->kind == SHAPE_PIE)
+  {
+    node->minX = shape->x1 - shape->x2 - pad;
+    node->maxX = shape->x1 + shape->x2 + pad;
+    node->minY = shape->y1 - shape->y2 - pad;
+    node->maxY = shape->y1 + shape->y2 + pad;
+  }
+  else if (shape->kind == SHAPE_POLY || shape->kind == SHAPE_FILLED_POLY)
+  {
+    node->minX = node->minY = 0x7FFFFFFF;
+    node->maxX = node->maxY = -0x7FFFFFFF;
+    for (TImageCoordList::iterator iter = shape->coords.begin(); iter != shape->coords.end(); iter++)
+    {
+      node->minX = min(node->minX, iter->first - pad);
+      node->maxX = max(node->maxX, iter->first + pad);
+      node->minY = min(node->minY, iter->second - pad);
+      node->maxY = max(node->maxY, iter->second + pad);
+    }
+  }
+  else
+  {
+    node->minX = min(shape->x1, shape->x2) - pad;
+    node->maxX = max(shape->x1, shape->x2) + pad;
+    node->minY = min(shape->y1, shape->y2) - pad;
+    node->maxY = max(shape->y1, shape->y2) + pad;
+  }
+}
+
+// Subprocess that sets a node's bounds to the union of its children
+void UnionSceneBounds(SceneNode *node, SceneNode *a, SceneNode *b)
+{
+  node->minX = min(a->minX, b->minX);
+  node->minY = min(a->minY, b->minY);
+  node->maxX = max(a->maxX, b->maxX);
+  node->maxY = max(a->maxY, b->maxY);
+}
+
+// Subprocess that returns the perimeter of the union of two bounds, used as insertion cost
+int64_t UnionScenePerimeter(SceneNode *a, SceneNode *b)
+{
+  return (int64_t)max(a->maxX, b->maxX) - min(a->minX, b->minX) + (int64_t)max(a->maxY, b->maxY) - min(a->minY, b->minY);
+}
+
+// Subprocess that allocates a tree node, reusing freed ones
+int AllocSceneNode(Scene *scene)
+{
+  SceneNode node = {0, 0, 0, 0, -1, -1, -1, 0, -1};
+
+  if (!scene->freeNodes.empty())
+  {
+    int index = scene->freeNodes.back();
+    scene->freeNodes.pop_back();
+    scene->nodes[index] = node;
+    return index;
+  }
+
+  scene->nodes.push_back(node);
+  return scene->nodes.size() - 1;
+}
+
+// Subprocess that points the parent of a node at a replacement, or makes the replacement root
+void ReplaceSceneChild(Scene *scene, int parent, int oldChild, int newChild)
+{
+  if (parent == -1)
+    scene->root = newChild;
+  else if (scene->nodes[parent].left == oldChild)
+    scene->nodes[parent].left = newChild;
+  else
+    scene->nodes[parent].right = newChild;
+}
+
+// Subprocess that rotates a taller grandchild up to keep the tree balanced, returns the new subtree root
+int BalanceSceneNode(Scene *scene, int iA)
+{
+  std::vector<SceneNode> &nodes = scene->nodes;
+
+  if (nodes[iA].left == -1 || nodes[iA].height < 2)
+    return iA;
+
+  int iB = nodes[iA].left;
+  int iC = nodes[iA].right;
+  int balance = nodes[iC].height - nodes[iB].height;
+
+  if (balance > -2 && balance < 2)
+    return iA;
+
+  // Rotate the taller child up, it keeps its taller grandchild and hands the other one to A
+  int iUp = balance > 1 ? iC : iB;
+  int iStay = balance > 1 ? iB : iC;
+  int iF = nodes[iUp].left;
+  int iG = nodes[iUp].right;
+  int iTall = nodes[iF].height > nodes[iG].height ? iF : iG;
+  int iShort = iTall == iF ? iG : iF;
+
+  nodes[iUp].parent = nodes[iA].parent;
+  ReplaceSceneChild(scene, nodes[iA].parent, iA, iUp);
+  nodes[iUp].left = iA;
+  nodes[iUp].right = iTall;
+  nodes[iA].parent = iUp;
+  nodes[iA].left = iStay;
+  nodes[iA].right = iShort;
+  nodes[iShort].parent = iA;
+
+  UnionSceneBounds(&nodes[iA], &nodes[iStay], &nodes[iShort]);
+  nodes[iA].height = 1 + max(nodes[iStay].height, nodes[iShort].height);
+  UnionSceneBounds(&nodes[iUp], &nodes[iA], &nodes[iTall]);
+  nodes[iUp].height = 1 + max(nodes[iA].height, nodes[iTall].height);
+  return iUp;
+}
+
+// Subprocess that walks from a node to the root, rebalancing and refitting bounds and heights
+void RefitSceneNodes(Scene *scene, int index)
+{
+  std::vector<SceneNode> &nodes = scene->nodes;
+
+  while (index != -1)
+  {
+    index = BalanceSceneNode(scene, index);
+    int left = nodes[index].left;
+    int right = nodes[index].right;
+    nodes[index].height = 1 + max(nodes[left].height, nodes[right].height);
+    UnionSceneBounds(&nodes[index], &nodes[left], &nodes[right]);
+    index = nodes[index].parent;
+  }
+}
+
+// Subprocess that inserts a leaf next to the sibling that grows the tree's perimeter the least
+void InsertSceneLeaf(Scene *scene, int leaf)
+{
+  std::vector<SceneNode> &nodes = scene->nodes;
+
+  if (scene->root == -1)
+  {
+    scene->root = leaf;
+    nodes[leaf].parent = -1;
+    return;
+  }
+
+  int index = scene->root;
+  while (nodes[index].left != -1)
+  {
+    SceneNode *node = &nodes[index];
+    int64_t area = (int64_t)node->maxX - node->minX + (int64_t)node->maxY - node->minY;
+    int64_t combined = UnionScenePerimeter(node, &nodes[leaf]);
+    int64_t cost = 2 * combined;
+    int64_t inheritance = 2 * (combined - area);
+    int64_t childCost[2];
+    int children[2] = {node->left, node->right};
+
+    for (int i = 0; i < 2; i++)
+    {
+      SceneNode *child = &nodes[children[i]];
+      childCost[i] = UnionScenePerimeter(child, &nodes[leaf]) + inheritance;
+      if (child->left != -1)
+        childCost[i] -= (int64_t)child->maxX - child->minX + (int64_t)child->maxY - child->minY;
+    }
+
+    if (cost < childCost[0] && cost < childCost[1])
+      break;
+
+    index = childCost[0] < childCost[1] ? children[0] : children[1];
+  }
+
+  int sibling = index;
+  int oldParent = nodes[sibling].parent;
+  int newParent = AllocSceneNode(scene);
+
+  nodes[newParent].parent = oldParent;
+  nodes[newParent].left = sibling;
+  nodes[newParent].right = leaf;
+  nodes[newParent].height = nodes[sibling].height + 1;
+  UnionSceneBounds(&nodes[newParent], &nodes[sibling], &nodes[leaf]);
+  ReplaceSceneChild(scene, oldParent, sibling, newParent);
+  nodes[sibling].parent = newParent;
+  nodes[leaf].parent = newParent;
+
+  RefitSceneNodes(scene, nodes[leaf].parent);
+}
+
+// Subprocess that unlinks a leaf, its sibling takes the place of their parent
+void RemoveSceneLeaf(Scene *scene, int leaf)
+{
+  std::vector<SceneNode> &nodes = scene->nodes;
+
+  if (leaf == scene->root)
+  {
+    scene->root = -1;
+    return;
+  }
+
+  int parent = nodes[leaf].parent;
+  int grandParent = nodes[parent].parent;
+  int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+  ReplaceSceneChild(scene, grandParent, parent, sibling);
+  nodes[sibling].parent = grandParent;
+  scene->freeNodes.push_back(parent);
+  RefitSceneNodes(scene, grandParent);
+}
+
+// Subprocess that collects shapes whose bounds overlap a rectangle
+void QueryScene(Scene *scene, int x1, int y1, int x2, int y2, std::vector<int> *shapes)
+{
+  std::vector<int> stack;
+
+  if (scene->root != -1)
+    stack.push_back(scene->root);
+
+  while (!stack.empty())
+  {
+    SceneNode *node = &scene->nodes[stack.back()];
+    stack.pop_back();
+
+    if (node->maxX < x1 || node->minX > x2 || node->maxY < y1 || node->minY > y2)
+      continue;
+
+    if (node->left == -1)
+      shapes->push_back(node->shape);
+    else
+    {
+      stack.push_back(node->left);
+      stack.push_back(node->right);
+    }
+  }
+}
+
+// Subprocess that orders shape ids by the order they were added in
+void SortByDrawOrder(Scene *scene, std::vector<int> *shapes, bool topmostFirst)
+{
+  std::vector<std::pair<unsigned long, int> > ordered;
+
+  for (std::vector<int>::iterator iter = shapes->begin(); iter != shapes->end(); iter++)
+    ordered.push_back(std::make_pair(scene->drawOrder[*iter], *iter));
+  std::sort(ordered.begin(), ordered.end());
+
+  shapes->clear();
+  for (size_t i = 0; i < ordered.size(); i++)
+    shapes->push_back(ordered[topmostFirst ? ordered.size() - 1 - i : i].second);
+}
+
+// Interface to create an empty retained scene
+Scene *CreateScene()
+{
+  Scene *scene = new Scene;
+  scene->root = -1;
+  scene->nextOrder = 0;
+  return scene;
+}
+
+// Interface to free a retained scene
+void FreeScene(Scene *scene)
+{
+  delete scene;
+}
+
+// Interface to add a shape to a scene, returns its id, ids of removed shapes are reused
+int SceneAdd(Scene *scene, const SceneShape *shape)
+{
+  int id;
+
+  if (!scene->freeShapes.empty())
+  {
+    id = scene->freeShapes.back();
+    scene->freeShapes.pop_back();
+    scene->shapes[id] = *shape;
+  }
+  else
+  {
+    id = scene->shapes.size();
+    scene->shapes.push_back(*shape);
+    scene->leafOf.push_back(-1);
+    scene->drawOrder.push_back(0);
+  }
+
+  int leaf = AllocSceneNode(scene);
+  scene->nodes[leaf].shape = id;
+  GetShapeBounds(&scene->shapes[id], &scene->nodes[leaf]);
+  scene->leafOf[id] = leaf;
+  scene->drawOrder[id] = scene->nextOrder++;
+  InsertSceneLeaf(scene, leaf);
+  return id;
+}
+
+// Subprocess that builds a shape of the given kind with the current drawing state
+SceneShape MakeSceneShape(SceneShapeKind kind, int x1, int y1, int x2, int y2, int a1 = -1, int a2 = -1, int flag = 0)
+{
+  SceneShape shape;
+
+  shape.kind = kind;
+  shape.x1 = x1;
+  shape.y1 = y1;
+  shape.x2 = x2;
+  shape.y2 = y2;
+  shape.a1 = a1;
+  shape.a2 = a2;
+  shape.flag = flag;
+  CaptureDrawState(&shape.state);
+  return shape;
+}
+
+// Interfaces to add shapes with the current drawing state, mirroring the drawing interfaces
+int SceneAddLine(Scene *scene, int x1, int y1, int x2, int y2, int omitEndpoints = 0)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_LINE, x1, y1, x2, y2, -1, -1, omitEndpoints);
+  return SceneAdd(scene, &shape);
+}
+
+int SceneAddRect(Scene *scene, int x1, int y1, int x2, int y2)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_RECT, x1, y1, x2, y2);
+  return SceneAdd(scene, &shape);
+}
+
+int SceneAddBox(Scene *scene, int x1, int y1, int x2, int y2)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_BOX, x1, y1, x2, y2);
+  return SceneAdd(scene, &shape);
+}
+
+int SceneAddPoly(Scene *scene, TImageCoordList *coordList)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_POLY, 0, 0, 0, 0);
+  shape.coords = *coordList;
+  return SceneAdd(scene, &shape);
+}
+
+int SceneAddFilledPoly(Scene *scene, TImageCoordList *coordList)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_FILLED_POLY, 0, 0, 0, 0);
+  shape.coords = *coordList;
+  return SceneAdd(scene, &shape);
+}
+
+int SceneAddEllipse(Scene *scene, int x, int y, int rx, int ry, int a1 = -1, int a2 = -1, int radii = 0)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_ELLIPSE, x, y, rx, ry, a1, a2, radii);
+  return SceneAdd(scene, &shape);
+}
+
+int SceneAddPie(Scene *scene, int x, int y, int rx, int ry, int a1 = -1, int a2 = -1)
+{
+  SceneShape shape = MakeSceneShape(SHAPE_PIE, x, y, rx, ry, a1, a2);
+  return SceneAdd(scene, &shape);
+}
+
+// Interface to get a shape for editing, call SceneUpdate afterwards, returns NULL for unknown ids
+SceneShape *SceneGetShape(Scene *scene, int id)
+{
+  if (id < 0 || id >= (int)scene->shapes.size() || scene->leafOf[id] == -1)
+    return NULL;
+
+  return &scene->shapes[id];
+}
+
+// Interface to reindex a shape after editing it, it keeps its place in the draw order
+int SceneUpdate(Scene *scene, int id)
+{
+  if (SceneGetShape(scene, id) == NULL)
+    return -1;
+
+  int leaf = scene->leafOf[id];
+  RemoveSceneLeaf(scene, leaf);
+  GetShapeBounds(&scene->shapes[id], &scene->nodes[leaf]);
+  InsertSceneLeaf(scene, leaf);
+  return 0;
+}
+
+// Interface to remove a shape from a scene
+int SceneRemove(Scene *scene, int id)
+{
+  if (SceneGetShape(scene, id) == NULL)
+    return -1;
+
+  RemoveSceneLeaf(scene, scene->leafOf[id]);
+  scene->freeNodes.push_back(scene->leafOf[id]);
+  scene->leafOf[id] = -1;
+  scene->shapes[id].coords.clear();
+  scene->freeShapes.push_back(id);
+  return 0;
+}
+
+// Subprocess that sets up an empty occlusion mask over a rectangle clipped to the canvas
+void initOcclusionMask(OcclusionMask *mask, int minX, int minY, int maxX, int maxY, int canvasX, int canvasY)
+{
+  mask->minX = max(minX, 0);
+  mask->minY = max(minY, 0);
+  mask->width = max(min(maxX, canvasX - 1) - mask->minX + 1, 0);
+  mask->height = max(min(maxY, canvasY - 1) - mask->minY + 1, 0);
+  mask->words = (mask->width + 63) >> 6;
+  mask->bits.assign((size_t)mask->words * mask->height, 0);
+}
+
+// Subprocess that finds the first pixel of a mask row from x up to end whose bit is set or clear, returns end if there is none
+int findMaskBit(const uint64_t *row, int x, int end, int set)
+{
+  uint64_t word;
+
+  while (x < end)
+  {
+    word = (set ? row[x >> 6] : ~row[x >> 6]) & (~0ULL << (x & 63));
+    if (word)
+      return min((x & ~63) + __builtin_ctzll(word), end);
+    x = (x & ~63) + 64;
+  }
+
+  return end;
+}
+
+// Subprocess that marks a run of pixels in a mask row as owned, a word at a time
+void setMaskBits(uint64_t *row, int x, int end)
+{
+  int bit, n;
+
+  while (x < end)
+  {
+    bit = x & 63;
+    n = min(64 - bit, end - x);
+    row[x >> 6] |= (n == 64 ? ~0ULL : ((1ULL << n) - 1) << bit);
+    x += n;
+  }
+}
+
+// Subprocess that checks whether every on-canvas pixel of a rectangle is already owned
+bool isMaskCovered(OcclusionMask *mask, int minX, int minY, int maxX, int maxY)
+{
+  minX = max(minX, mask->minX) - mask->minX;
+  minY = max(minY, mask->minY) - mask->minY;
+  maxX = min(maxX, mask->minX + mask->width - 1) - mask->minX;
+  maxY = min(maxY, mask->minY + mask->height - 1) - mask->minY;
+
+  for (int y = minY; y <= maxY; y++)
+    if (findMaskBit(&mask->bits[(size_t)y * mask->words], minX, maxX + 1, 0) <= maxX)
+      return false;
+
+  return true;
+}
+
+// Subprocess that walks recorded runs from last to first, keeping the pieces no later opaque pixel overwrites and
+// claiming the pixels of opaque runs, kept pieces come out in reverse draw order
+void resolveOcclusion(OcclusionMask *mask, const std::vector<StampRun> *runs, std::vector<StampRun> *kept)
+{
+  StampRun run, piece;
+  uint64_t *row;
+  int x0, x1, lo, hi, x, end;
+
+  for (size_t k = runs->size(); k-- > 0;)
+  {
+    run = (*runs)[k];
+    x0 = run.x - mask->minX;
+    x1 = x0 + run.length;
+    lo = max(x0, 0);
+    hi = min(x1, mask->width);
+
+    // Nothing outside the mask is owned
+    if (run.y < mask->minY || run.y >= mask->minY + mask->height || lo >= hi)
+    {
+      kept->push_back(run);
+      continue;
+    }
+
+    piece = run;
+    if (x0 < lo)
+    {
+      piece.length = lo - x0;
+      kept->push_back(piece);
+    }
+    if (x1 > hi)
+    {
+      piece.x = mask->minX + hi;
+      piece.length = x1 - hi;
+      kept->push_back(piece);
+    }
+
+    // Pieces of the run inside the mask that are still unowned
+    row = &mask->bits[(size_t)(run.y - mask->minY) * mask->words];
+    occludedPixels += hi - lo;
+    for (x = findMaskBit(row, lo, hi, 0); x < hi; x = findMaskBit(row, end, hi, 0))
+    {
+      end = findMaskBit(row, x, hi, 1);
+      piece.x = mask->minX + x;
+      piece.length = end - x;
+      kept->push_back(piece);
+      occludedPixels -= end - x;
+    }
+
+    // Blending with alpha 255 overwrites, so anything drawn under an opaque pixel earlier is lost anyway
+    if ((run.alpha & 0xFF) == 255)
+      setMaskBits(row, lo, hi);
+  }
+}
+
+// Subprocess that draws kept runs, which come in reverse draw order
+void drawKeptRuns(std::vector<StampRun> *kept)
+{
+  for (size_t k = kept->size(); k-- > 0;)
+    DrawSpan((*kept)[k].x, (*kept)[k].y, (*kept)[k].length, (*kept)[k].col, (*kept)[k].alpha);
+}
+
+// Subprocess that draws scene shapes with overdraw elimination, shapes are rasterized from the top down and the ones
+// completely under later opaque pixels are not rasterized at all
+void DrawSceneOccluded(Scene *scene, std::vector<int> *visible)
+{
+  OcclusionMask mask;
+  std::vector<StampRun> runs, kept;
+  RenderTarget *boundTarget = renderTarget;
+  SceneNode *node;
+  int canvasX, canvasY, minX = INT_MAX, minY = INT_MAX, maxX = INT_MIN, maxY = INT_MIN;
+
+  if (GetCanvasSize(&canvasX, &canvasY))
+    return;
+
+  StampRecorder recorder = {{canvasX, canvasY, PlotStampRecorder, SpanStampRecorder}, 0, 0, &runs};
+  for (std::vector<int>::iterator iter = visible->begin(); iter != visible->end(); iter++)
+  {
+    node = &scene->nodes[scene->leafOf[*iter]];
+    minX = min(minX, node->minX);
+    minY = min(minY, node->minY);
+    maxX = max(maxX, node->maxX);
+    maxY = max(maxY, node->maxY);
+  }
+  initOcclusionMask(&mask, minX, minY, maxX, maxY, canvasX, canvasY);
+
+  for (size_t i = visible->size(); i-- > 0;)
+  {
+    // Shape bounds are conservative, so a fully owned box means no pixel of the shape can show
+    node = &scene->nodes[scene->leafOf[(*visible)[i]]];
+    if (isMaskCovered(&mask, node->minX, node->minY, node->maxX, node->maxY))
+    {
+      occludedShapes++;
+      continue;
+    }
+
+    runs.clear();
+    ApplyDrawState(&scene->shapes[(*visible)[i]].state);
+    renderTarget = &recorder.target;
+    DrawSceneShape(&scene->shapes[(*visible)[i]]);
+    renderTarget = boundTarget;
+    resolveOcclusion(&mask, &runs, &kept);
+  }
+
+  drawKeptRuns(&kept);
+}
+
+// Interface to start recording drawing for overdraw elimination, returns -1 if a pass is already open or there is no canvas
+int BeginOcclusionPass()
+{
+  int canvasX, canvasY;
+
+  if (occlusionPass.active || GetCanvasSize(&canvasX, &canvasY))
+    return -1;
+
+  occlusionPass.runs.clear();
+  occlusionPass.target = renderTarget;
+  occlusionPass.recorder = {{canvasX, canvasY, PlotStampRecorder, SpanStampRecorder}, 0, 0, &occlusionPass.runs};
+  occlusionPass.active = 1;
+  renderTarget = &occlusionPass.recorder.target;
+  return 0;
+}
+
+// Interface to draw everything recorded since BeginOcclusionPass, skipping pixels that a later opaque pixel overwrites
+void EndOcclusionPass()
+{
+  OcclusionMask mask;
+  std::vector<StampRun> kept;
+
+  if (!occlusionPass.active)
+    return;
+
+  renderTarget = occlusionPass.target;
+  occlusionPass.active = 0;
+
+  initOcclusionMask(&mask, 0, 0, occlusionPass.recorder.target.width - 1, occlusionPass.recorder.target.height - 1,
+                    occlusionPass.recorder.target.width, occlusionPass.recorder.target.height);
+  resolveOcclusion(&mask, &occlusionPass.runs, &kept);
+  occlusionPass.runs.clear();
+  drawKeptRuns(&kept);
+}
+
+// Interface to draw the shapes of a scene that overlap a viewport, in the order they were added
+void DrawScene(Scene *scene, int x1, int y1, int x2, int y2)
+{
+  std::vector<int> visible;
+  DrawState saved;
+
+  QueryScene(scene, min(x1, x2), min(y1, y2), max(x1, x2), max(y1, y2), &visible);
+  SortByDrawOrder(scene, &visible, false);
+
+  CaptureDrawState(&saved);
+  if (sceneOcclusion)
+    DrawSceneOccluded(scene, &visible);
+  else
+    for (std::vector<int>::iterator iter = visible.begin(); iter != visible.end(); iter++)
+    {
+      ApplyDrawState(&scene->shapes[*iter].state);
+      DrawSceneShape(&scene->shapes[*iter]);
+    }
+  ApplyDrawState(&saved);
+}
+
+// Subprocess that returns the distance of a point to a line segment
+double SegmentDistance(double px, double py, double x1, double y1, double x2, double y2)
+{
+  double dx = x2 - x1, dy = y2 - y1;
+  double len2 = dx * dx + dy * dy;
+  double t = len2 == 0 ? 0 : ((px - x1) * dx + (py - y1) * dy) / len2;
+
+  t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  return hypot(px - (x1 + t * dx), py - (y1 + t * dy));
+}
+
+// Subprocess that checks whether an angle in degrees lies within the clockwise sector a1 to a2
+bool AngleInSector(double angle, int a1, int a2)
+{
+  if ((a1 < 0 && a2 < 0) || a1 == a2)
+    return true;
+
+  double ta1 = max(a1, 0);
+  double ta2 = a2 < 0 ? 360 : min(a2, 360);
+  if (ta1 <= ta2)
+    return angle >= ta1 && angle <= ta2;
+  return angle >= ta1 || angle <= ta2;
+}
+
+// Subprocess that tests whether a point hits the pixels of a retained shape
+bool HitSceneShape(SceneShape *shape, int x, int y)
+{
+  // Half the line width plus slack for the rounding of the rasterizers
+  double reach = shape->state.lineWidth / 2.0 + 1;
+
+  switch (shape->kind)
+  {
+  case SHAPE_LINE:
+    return SegmentDistance(x, y, shape->x1, shape->y1, shape->x2, shape->y2) <= reach;
+  case SHAPE_BOX:
+  case SHAPE_RECT:
+    // Boxes hit inside as well as on their outline
+    if (shape->kind == SHAPE_BOX && x >= min(shape->x1, shape->x2) && x <= max(shape->x1, shape->x2) &&
+        y >= min(shape->y1, shape->y2) && y <= max(shape->y1, shape->y2))
+      return true;
+    return SegmentDistance(x, y, shape->x1, shape->y1, shape->x2, shape->y1) <= reach ||
+           SegmentDistance(x, y, shape->x2, shape->y1, shape->x2, shape->y2) <= reach ||
+           SegmentDistance(x, y, shape->x2, shape->y2, shape->x1, shape->y2) <= reach ||
+           SegmentDistance(x, y, shape->x1, shape->y2, shape->x1, shape->y1) <= reach;
+  case SHAPE_POLY:
+  case SHAPE_FILLED_POLY:
+  {
+    bool inside = false;
+    TImageCoordList::iterator prev = shape->coords.end();
+    for (TImageCoordList::iterator iter = shape->coords.begin(); iter != shape->coords.end(); prev = iter++)
+    {
+      // Outlines are open for DrawPoly and closed for DrawFilledPoly
+      if (prev == shape->coords.end())
+      {
+        if (shape->kind == SHAPE_POLY)
+          continue;
+        prev = shape->coords.end() - 1;
+      }
+      if (SegmentDistance(x, y, prev->first, prev->second, iter->first, iter->second) <= reach)
+        return true;
+      if ((iter->second > y) != (prev->second > y) &&
+          x < (double)(prev->first - iter->first) * (y - iter->second) / (prev->second - iter->second) + iter->first)
+        inside = !inside;
+    }
+    return shape->kind == SHAPE_FILLED_POLY && inside;
+  }
+  case SHAPE_ELLIPSE:
+  case SHAPE_PIE:
+  {
+    double rx = max(shape->x2, 1);
+    double ry = max(shape->y2, 1);
+    double nx = (x - shape->x1) / rx;
+    double ny = (y - shape->y1) / ry;
+    double radius = hypot(nx, ny);
+    double angle = atan2(ny, nx) * 180 / M_PI;
+    if (angle < 0)
+      angle += 360;
+
+    // Radius lines close sectors of pies and of ellipses drawn with radii
+    if ((shape->kind == SHAPE_PIE || shape->flag) && !((shape->a1 < 0 && shape->a2 < 0) || shape->a1 == shape->a2))
+      for (int i = 0; i < 2; i++)
+      {
+        double a = (i ? shape->a2 : shape->a1) * M_PI / 180;
+        if (SegmentDistance(x, y, shape->x1, shape->y1, shape->x1 + cos(a) * rx, shape->y1 + sin(a) * ry) <= reach)
+          return true;
+      }
+
+    if (!AngleInSector(angle, shape->a1, shape->a2))
+      return false;
+    if (shape->kind == SHAPE_PIE && radius <= 1)
+      return true;
+    // Distance to the outline measured along the ray from the center
+    return radius > 0 && hypot(x - shape->x1, y - shape->y1) * fabs(1 - 1 / radius) <= reach;
+  }
+  }
+
+  return false;
+}
+
+// Interface to find the shapes drawn at a point, topmost first
+void PickScene(Scene *scene, int x, int y, std::vector<int> *hits)
+{
+  std::vector<int> candidates;
+
+  QueryScene(scene, x, y, x, y, &candidates);
+  hits->clear();
+  for (std::vector<int>::iterator iter = candidates.begin(); iter != candidates.end(); iter++)
+    if (HitSceneShape(&scene->shapes[*iter], x, y))
+      hits->push_back(*iter);
+  SortByDrawOrder(scene, hits, true);
+}
+
+// Interface to find the shapes whose bounds overlap a rectangle, topmost first
+void PickSceneRect(Scene *scene, int x1, int y1, int x2, int y2, std::vector<int> *hits)
+{
+  hits->clear();
+  QueryScene(scene, min(x1, x2), min(y1, y2), max(x1, x2), max(y1, y2), hits);
+  SortByDrawOrder(scene, hits, true);
+}
+
+// Subprocess that simplifies an open chain of vertices with Douglas-Peucker, first and last vertices are always kept
+void SimplifyChain(TImageCoordList *source, double tolerance, TImageCoordList *result)
+{
+  size_t n = source->size();
+  std::vector<char> keep(n, n < 3);
+  std::vector<std::pair<size_t, size_t> > stack;
+
+  result->clear();
+  if (n >= 3)
+  {
+    keep[0] = keep[n - 1] = 1;
+    stack.push_back(std::make_pair((size_t)0, n - 1));
+  }
+
+  while (!stack.empty())
+  {
+    size_t first = stack.back().first;
+    size_t last = stack.back().second;
+    size_t farthest = first;
+    double farthestDist = -1;
+    TImageCoordPair a = (*source)[first], b = (*source)[last];
+    stack.pop_back();
+
+    for (size_t i = first + 1; i < last; i++)
+    {
+      double dist = SegmentDistance((*source)[i].first, (*source)[i].second, a.first, a.second, b.first, b.second);
+      if (dist > farthestDist)
+      {
+        farthestDist = dist;
+        farthest = i;
+      }
+    }
+
+    // Polygons always keep a third vertex so they never collapse to a line
+    if (farthest != first && (farthestDist > tolerance || (first == 0 && last == n - 1)))
+    {
+      keep[farthest] = 1;
+      if (farthestDist > tolerance)
+      {
+        stack.push_back(std::make_pair(first, farthest));
+        stack.push_back(std::make_pair(farthest, last));
+      }
+    }
+  }
+
+  for (size_t i = 0; i < n; i++)
+    if (keep[i])
+      result->push_back((*source)[i]);
+}
+
+// Interface to set up a level of detail polygon from vertices in source units
+void InitPolyLod(PolyLod *lod, TImageCoordList *coordList)
+{
+  lod->source = *coordList;
+  lod->levels.clear();
+}
+
+// Subprocess that picks the level matching the current scale, building and caching it on first use
+TImageCoordList *GetPolyLodLevel(PolyLod *lod)
+{
+  double tolerance = lodTolerance / lodScale;
+
+  // Below a source unit there is nothing to simplify
+  if (!(tolerance >= 1))
+    return &lod->source;
+
+  int level = (int)floor(log2(tolerance));
+  std::map<int, TImageCoordList>::iterator found = lod->levels.find(level);
+  if (found != lod->levels.end())
+    return &found->second;
+
+  TImageCoordList *simplified = &lod->levels[level];
+  SimplifyChain(&lod->source, ldexp(1.0, level), simplified);
+  return simplified;
+}
+
+// Subprocess that maps a source vertex to pixels
+TImageCoordPair LodToPixel(TImageCoordPair vertex)
+{
+  return std::make_pair((int)floor(vertex.first * lodScale + lodOffsetX + 0.5), (int)floor(vertex.second * lodScale + lodOffsetY + 0.5));
+}
+
+// Interface to draw a level of detail polygon like DrawPoly, vertices snapping to the same pixel are merged
+void DrawPolyLod(PolyLod *lod)
+{
+  TImageCoordList *level = GetPolyLodLevel(lod);
+  TImageCoordPair last, vertex;
+  bool started = false, endPoints = true;
+
+  for (TImageCoordList::iterator iter = level->begin(); iter != level->end(); iter++)
+  {
+    vertex = LodToPixel(*iter);
+    if (started && vertex != last)
+    {
+      DrawLine(last.first, last.second, vertex.first, vertex.second, endPoints);
+      endPoints = !endPoints;
+    }
+    last = vertex;
+    started = true;
+  }
+}
+
+// Interface to draw a level of detail polygon like DrawFilledPoly, vertices snapping to the same pixel are merged
+void DrawFilledPolyLod(PolyLod *lod)
+{
+  TImageCoordList *level = GetPolyLodLevel(lod);
+  EdgeTableBuilder builder;
+  std::vector<TImageCoordPair> outline;
+  int minY, maxY, canvasX, canvasY;
+  if (GetCanvasSize(&canvasX, &canvasY) || level->size() < 2)
+    return;
+
+  minY = maxY = LodToPixel(level->front()).second;
+  for (TImageCoordList::iterator iter = level->begin(); iter != level->end(); iter++)
+  {
+    int y = LodToPixel(*iter).second;
+    minY = min(minY, y);
+    maxY = max(maxY, y);
+  }
+
+  Edge **edgeTable = (Edge **)calloc(maxY - minY + 1, sizeof(Edge *));
+  if (edgeTable == NULL)
+    return;
+
+  beginEdgeTable(&builder, edgeTable, minY, &outline);
+  for (TImageCoordList::iterator iter = level->begin(); iter != level->end(); iter++)
+    addEdgeVertex(&builder, LodToPixel(*iter));
+  closeEdgeTable(&builder);
+
+  scanEdgeTable(edgeTable, minY, maxY, &outline);
+  free(edgeTable);
+}
+
+// Subprocess that reads a vertex of a polygon view, float vertices are rounded to pixels, GetGeometryPolygon has checked them
+TImageCoordPair GetViewVertex(const PolyView *view, size_t i)
+{
+  if (view->vertexType == GEOMETRY_FLOAT32)
+  {
+    const float *xy = (const float *)view->xy + 2 * i;
+    return std::make_pair((int)floor(xy[0] + 0.5f), (int)floor(xy[1] + 0.5f));
+  }
+
+  const int32_t *xy = (const int32_t *)view->xy + 2 * i;
+  return std::make_pair((int)xy[0], (int)xy[1]);
+}
+
+// Interface to draw an unfilled polygon view like DrawPoly
+void DrawPolyView(const PolyView *view)
+{
+  bool endPoints = true;
+
+  for (size_t i = 0; i + 1 < view->count; i++)
+  {
+    TImageCoordPair a = GetViewVertex(view, i);
+    TImageCoordPair b = GetViewVertex(view, i + 1);
+    DrawLine(a.first, a.second, b.first, b.second, endPoints);
+    endPoints = !endPoints;
+  }
+}
+
+// Interface to draw a filled polygon view like DrawFilledPoly
+void DrawFilledPolyView(const PolyView *view)
+{
+  EdgeTableBuilder builder;
+  std::vector<TImageCoordPair> outline;
+  int minY, maxY, canvasX, canvasY;
+  if (GetCanvasSize(&canvasX, &canvasY) || view->count < 2)
+    return;
+
+  minY = maxY = GetViewVertex(view, 0).second;
+  for (size_t i = 1; i < view->count; i++)
+  {
+    int y = GetViewVertex(view, i).second;
+    minY = min(minY, y);
+    maxY = max(maxY, y);
+  }
+
+  Edge **edgeTable = (Edge **)calloc(maxY - minY + 1, sizeof(Edge *));
+  if (edgeTable == NULL)
+    return;
+
+  beginEdgeTable(&builder, edgeTable, minY, &outline);
+  for (size_t i = 0; i < view->count; i++)
+    addEdgeVertex(&builder, GetViewVertex(view, i));
+  closeEdgeTable(&builder);
+
+  scanEdgeTable(edgeTable, minY, maxY, &outline);
+  free(edgeTable);
+}
+
+// Interface to write polygons to a binary geometry file
+int WriteGeometryFile(const char *path, const TImageCoordList *polygons, size_t count, GeometryVertexType vertexType = GEOMETRY_INT32)
+{
+  GeometryHeader header;
+  uint64_t start = 0;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "GLGEOM1", 8);
+  header.vertexType = vertexType;
+  header.polygonCount = count;
+  header.indexOffset = sizeof(GeometryHeader);
+  header.vertexOffset = header.indexOffset + (count + 1) * sizeof(uint64_t);
+
+  FILE *out = fopen(path, "wb");
+  if (out == NULL)
+    return -1;
+
+  bool failed = fwrite(&header, sizeof(header), 1, out) != 1;
+  for (size_t i = 0; i <= count && !failed; i++)
+  {
+    failed = fwrite(&start, sizeof(start), 1, out) != 1;
+    if (i < count)
+      start += polygons[i].size();
+  }
+
+  for (size_t i = 0; i < count && !failed; i++)
+  {
+    for (TImageCoordList::const_iterator iter = polygons[i].begin(); iter != polygons[i].end() && !failed; iter++)
+    {
+      if (vertexType == GEOMETRY_FLOAT32)
+      {
+        float xy[2] = {(float)iter->first, (float)iter->second};
+        failed = fwrite(xy, sizeof(xy), 1, out) != 1;
+      }
+      else
+      {
+        int32_t xy[2] = {iter->first, iter->second};
+        failed = fwrite(xy, sizeof(xy), 1, out) != 1;
+      }
+    }
+  }
+
+  if (fclose(out) || failed)
+    return -1;
+  return 0;
+}
+
+// Interface to memory map a binary geometry file, returns NULL if it is missing or malformed
+GeometryFile *OpenGeometryFile(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < (off_t)sizeof(GeometryHeader))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  GeometryFile *file = (GeometryFile *)malloc(sizeof(GeometryFile));
+  if (file == NULL)
+  {
+    munmap(map, size);
+    return NULL;
+  }
+
+  file->map = (const uint8_t *)map;
+  file->size = size;
+  memcpy(&file->header, map, sizeof(GeometryHeader));
+  file->index = (const uint64_t *)(file->map + file->header.indexOffset);
+  file->vertices = file->map + file->header.vertexOffset;
+
+  // Index and vertex arrays have to fit in the file
+  GeometryHeader *header = &file->header;
+  uint64_t vertexSize = 2 * sizeof(int32_t);
+  if (memcmp(header->magic, "GLGEOM1", 8) || header->vertexType > GEOMETRY_FLOAT32 ||
+      header->indexOffset % sizeof(uint64_t) || header->indexOffset > file->size ||
+      header->polygonCount >= (file->size - header->indexOffset) / sizeof(uint64_t) ||
+      header->vertexOffset % sizeof(int32_t) || header->vertexOffset > file->size ||
+      file->index[header->polygonCount] > (file->size - header->vertexOffset) / vertexSize)
+  {
+    munmap(map, size);
+    free(file);
+    return NULL;
+  }
+
+  return file;
+}
+
+// Interface to unmap a binary geometry file
+void CloseGeometryFile(GeometryFile *file)
+{
+  if (file == NULL)
+    return;
+
+  munmap((void *)file->map, file->size);
+  free(file);
+}
+
+// Interface to get a zero copy view of a polygon, returns -1 for bad polygons, including ones with non-finite vertices or
+// vertices further than GEOMETRY_COORD_LIMIT from the origin
+int GetGeometryPolygon(GeometryFile *file, uint64_t polygon, PolyView *view)
+{
+  size_t i;
+  if (polygon >= file->header.polygonCount)
+    return -1;
+
+  uint64_t start = file->index[polygon];
+  uint64_t end = file->index[polygon + 1];
+  if (start > end || end > file->index[file->header.polygonCount])
+    return -1;
+
+  view->xy = file->vertices + start * 2 * sizeof(int32_t);
+  view->count = end - start;
+  view->vertexType = (GeometryVertexType)file->header.vertexType;
+
+  // Vertices are checked once here, so drawing the view never converts or steps a wild value
+  if (view->vertexType == GEOMETRY_FLOAT32)
+  {
+    const float *xy = (const float *)view->xy;
+    for (i = 0; i < 2 * view->count; i++)
+      if (!(fabsf(xy[i]) <= GEOMETRY_COORD_LIMIT))
+        return -1;
+  }
+  else
+  {
+    const int32_t *xy = (const int32_t *)view->xy;
+    for (i = 0; i < 2 * view->count; i++)
+      if (xy[i] < -GEOMETRY_COORD_LIMIT || xy[i] > GEOMETRY_COORD_LIMIT)
+        return -1;
+  }
+
+  return 0;
+}
+
+// Subprocess that faults a range of a mapping into the page cache ahead of use
+void PrefetchGeometryRange(const uint8_t *start, size_t length)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  volatile uint8_t sink = 0;
+
+  madvise((void *)start, length, MADV_WILLNEED);
+  for (size_t offset = 0; offset < length; offset += page)
+    sink += start[offset];
+}
+
+// Interface to draw every polygon of a geometry file, streaming through it chunk by chunk
+void DrawGeometryFile(GeometryFile *file, int filled, size_t chunkBytes = 64 << 20, int prefetch = 1)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  size_t chunk = max(((chunkBytes + page - 1) / page) * page, (size_t)page);
+  size_t chunkStart = (file->header.vertexOffset / page) * page;
+  std::thread prefetcher;
+  PolyView view;
+
+  madvise((void *)file->map, file->size, MADV_SEQUENTIAL);
+
+  for (uint64_t polygon = 0; polygon < file->header.polygonCount; polygon++)
+  {
+    if (GetGeometryPolygon(file, polygon, &view))
+      continue;
+
+    // Once drawing moves past a chunk its pages are dropped so resident memory stays bounded
+    size_t offset = (const uint8_t *)view.xy - file->map;
+    if (offset >= chunkStart + chunk)
+    {
+      if (prefetcher.joinable())
+        prefetcher.join();
+
+      size_t newStart = (offset / page) * page;
+      madvise((void *)(file->map + chunkStart), newStart - chunkStart, MADV_DONTNEED);
+      chunkStart = newStart;
+
+      if (prefetch && chunkStart + chunk < file->size)
+        prefetcher = std::thread(PrefetchGeometryRange, file->map + chunkStart + chunk,
+                                 min(chunk, file->size - chunkStart - chunk));
+    }
+
+    if (filled)
+      DrawFilledPolyView(&view);
+    else
+      DrawPolyView(&view);
+  }
+
+  if (prefetcher.joinable())
+    prefetcher.join();
+  madvise((void *)file->map, file->size, MADV_DONTNEED);
+}
+
+// Batch command table, path commands take M, L, Q, C and Z verbs and markers a shape name between their numbers
+const BatchCommandInfo batchCommands[] = {
+    {"image", BATCH_IMAGE, 2, 2},
+    {"clear", BATCH_CLEAR, 3, 4},
+    {"color1", BATCH_COLOR1, 3, 3},
+    {"color2", BATCH_COLOR2, 3, 3},
+    {"alpha1", BATCH_ALPHA1, 1, 1},
+    {"alpha2", BATCH_ALPHA2, 1, 1},
+    {"lineWidth", BATCH_LINE_WIDTH, 1, 1},
+    {"linePattern", BATCH_LINE_PATTERN, 1, 1},
+    {"fillPattern", BATCH_FILL_PATTERN, 1, -1},
+    {"antiAlias", BATCH_ANTI_ALIAS, 1, 1},
+    {"curveTolerance", BATCH_CURVE_TOLERANCE, 1, 1},
+    {"stampCache", BATCH_STAMP_CACHE, 1, 1},
+    {"pixel", BATCH_PIXEL, 2, 2},
+    {"line", BATCH_LINE, 4, 5},
+    {"rect", BATCH_RECT, 4, 4},
+    {"box", BATCH_BOX, 4, 4},
+    {"poly", BATCH_POLY, 4, -1},
+    {"filledPoly", BATCH_FILLED_POLY, 4, -1},
+    {"ellipse", BATCH_ELLIPSE, 4, 7},
+    {"pie", BATCH_PIE, 4, 6},
+    {"bezier", BATCH_BEZIER, 6, 8},
+    {"path", BATCH_PATH, 1, -1},
+    {"filledPath", BATCH_FILLED_PATH, 1, -1},
+    {"markers", BATCH_MARKERS, 2, -1},
+    {"geometry", BATCH_GEOMETRY, 0, 1}};
+
+// Subprocess that looks up a batch command by name, returns NULL for unknown commands
+const BatchCommandInfo *findBatchCommand(const char *name, size_t length)
+{
+  for (size_t i = 0; i < sizeof(batchCommands) / sizeof(batchCommands[0]); i++)
+    if (strlen(batchCommands[i].name) == length && !strncmp(batchCommands[i].name, name, length))
+      return &batchCommands[i];
+
+  return NULL;
+}
+
+// Subprocess that reports a malformed batch line, returns -1 for convenience
+int batchError(int line, const char *message)
+{
+  fprintf(stderr, "batch line %d: %s\n", line, message);
+  return -1;
+}
+
+// Subprocess that classifies a batch line without reading past its end, returns 0 for blank lines and comments, 1 for
+// image commands with their size taken from the first two numbers like parseBatchJob does, and 2 for other commands
+int scanBatchLine(const char *p, const char *end, int *width, int *height)
+{
+  const char *token;
+  char *number;
+  double value;
+  int numbers = 0;
+
+  while (p < end && isspace((unsigned char)*p))
+    p++;
+  if (p == end || *p == '#')
+    return 0;
+
+  for (token = p; p < end && !isspace((unsigned char)*p); p++)
+    ;
+  if (p - token != 5 || strncmp(token, "image", 5))
+    return 2;
+
+  *width = *height = 0;
+  while (numbers < 2)
+  {
+    while (p < end && isspace((unsigned char)*p))
+      p++;
+    if (p == end || *p == '#')
+      break;
+    for (token = p; p < end && !isspace((unsigned char)*p); p++)
+      ;
+
+    value = strtod(token, &number);
+    if (number == p)
+      *(numbers++ ? height : width) = (int)value;
+  }
+
+  return 1;
+}
+
+// Subprocess that parses the lines of a batch image into commands and numeric arguments
+int parseBatchJob(const char *text, BatchWorker *worker, BatchJob *job)
+{
+  const BatchCommandInfo *info;
+  const char *p, *end, *token;
+  char *number;
+  size_t pos, lineEnd;
+  int line = job->line;
+  double value;
+  BatchCommand command;
+
+  worker->commands.clear();
+  worker->args.clear();
+
+  for (pos = job->begin; pos < job->end; pos = lineEnd + 1, line++)
+  {
+    for (lineEnd = pos; lineEnd < job->end && text[lineEnd] != '\n'; lineEnd++)
+      ;
+    p = text + pos;
+    end = text + lineEnd;
+
+    // Blank lines and comments
+    while (p < end && isspace((unsigned char)*p))
+      p++;
+    if (p == end || *p == '#')
+      continue;
+
+    for (token = p; p < end && !isspace((unsigned char)*p); p++)
+      ;
+    info = findBatchCommand(token, p - token);
+    if (info == NULL)
+      return batchError(line, "unknown command");
+
+    command.op = info->op;
+    command.line = line;
+    command.arg = worker->args.size();
+    command.word = command.wordLen = 0;
+
+    for (;;)
+    {
+      while (p < end && isspace((unsigned char)*p))
+        p++;
+      if (p == end || *p == '#')
+        break;
+      for (token = p; p < end && !isspace((unsigned char)*p); p++)
+        ;
+
+      value = strtod(token, &number);
+      if (number == p)
+        worker->args.push_back(value);
+      else if ((info->op == BATCH_PATH || info->op == BATCH_FILLED_PATH) && p - token == 1 && strchr("MLQCZ", *token))
+        worker->args.push_back(strchr("MLQCZ", *token) - "MLQCZ");
+      else if (info->op == BATCH_MARKERS && worker->args.size() == command.arg && p - token == 5 && !strncmp(token, "pixel", 5))
+        worker->args.push_back(MARKER_PIXEL);
+      else if (info->op == BATCH_MARKERS && worker->args.size() == command.arg && p - token == 6 && !strncmp(token, "square", 6))
+        worker->args.push_back(MARKER_SQUARE);
+      else if (info->op == BATCH_MARKERS && worker->args.size() == command.arg && p - token == 6 && !strncmp(token, "circle", 6))
+        worker->args.push_back(MARKER_CIRCLE);
+      else if ((info->op == BATCH_IMAGE || info->op == BATCH_GEOMETRY) && command.wordLen == 0)
+      {
+        command.word = token - text;
+        command.wordLen = p - token;
+      }
+      else
+        return batchError(line, "unexpected argument");
+    }
+
+    command.argCount = worker->args.size() - command.arg;
+    if ((int)command.argCount < info->minArgs || (info->maxArgs >= 0 && (int)command.argCount > info->maxArgs))
+      return batchError(line, "wrong number of arguments");
+    if ((info->op == BATCH_IMAGE || info->op == BATCH_GEOMETRY) && command.wordLen == 0)
+      return batchError(line, "missing file name");
+    if (((info->op == BATCH_POLY || info->op == BATCH_FILLED_POLY) && (command.argCount & 1)) ||
+        (info->op == BATCH_MARKERS && (command.argCount & 1)) ||
+        (info->op == BATCH_ELLIPSE && command.argCount == 5) ||
+        (info->op == BATCH_PIE && command.argCount == 5) ||
+        (info->op == BATCH_BEZIER && command.argCount == 7))
+      return batchError(line, "wrong number of arguments");
+
+    worker->commands.push_back(command);
+  }
+
+  return 0;
+}
+
+// Subprocess that builds a path from batch verbs and coordinates, returns -1 if a verb is short of points
+int buildBatchPath(BatchWorker *worker, BatchCommand *command)
+{
+  const double *a = &worker->args[command->arg];
+  const int points[] = {1, 1, 2, 3, 0};
+  size_t i = 0, n = command->argCount;
+  int verb;
+
+  worker->path.clear();
+  while (i < n)
+  {
+    verb = (int)a[i++];
+    if (verb < PATH_MOVE || verb > PATH_CLOSE || i + 2 * points[verb] > n)
+      return -1;
+
+    switch (verb)
+    {
+    case PATH_MOVE:
+      PathMoveTo(&worker->path, a[i], a[i + 1]);
+      break;
+    case PATH_LINE:
+      PathLineTo(&worker->path, a[i], a[i + 1]);
+      break;
+    case PATH_QUAD:
+      PathQuadTo(&worker->path, a[i], a[i + 1], a[i + 2], a[i + 3]);
+      break;
+    case PATH_CUBIC:
+      PathCubicTo(&worker->path, a[i], a[i + 1], a[i + 2], a[i + 3], a[i + 4], a[i + 5]);
+      break;
+    case PATH_CLOSE:
+      PathClose(&worker->path);
+      break;
+    }
+    i += 2 * points[verb];
+  }
+
+  return 0;
+}
+
+// Subprocess that fills the visible part of the worker framebuffer with a clear color
+void clearBatchImage(Image *image, color col, int alpha)
+{
+  size_t row = (size_t)image->target.width * image->channels;
+  uint8_t pixel[4] = {(uint8_t)col.red, (uint8_t)col.green, (uint8_t)col.blue, (uint8_t)alpha};
+
+  if (pixel[0] == 0 && pixel[1] == 0 && pixel[2] == 0 && (image->channels == 3 || pixel[3] == 0))
+  {
+    memset(image->pixels, 0, row * image->target.height);
+    return;
+  }
+
+  // First row is filled pixel by pixel and copied down
+  for (size_t i = 0; i < row; i += image->channels)
+    memcpy(image->pixels + i, pixel, image->channels);
+  for (int y = 1; y < image->target.height; y++)
+    memcpy(image->pixels + y * image->stride, image->pixels, row);
+}
+
+// Subprocess that draws the parsed commands of a batch image, the image command has already set up the framebuffer
+int renderBatchJob(const char *text, BatchWorker *worker)
+{
+  std::vector<BatchCommand>::iterator command;
+  GeometryFile *file;
+  const double *a;
+  size_t i, n;
+
+  for (command = worker->commands.begin() + 1; command != worker->commands.end(); command++)
+  {
+    a = worker->args.data() + command->arg;
+    n = command->argCount;
+
+    switch (command->op)
+    {
+    case BATCH_IMAGE:
+      return batchError(command->line, "image inside an image");
+    case BATCH_CLEAR:
+      clearBatchImage(worker->image, {(int)a[0], (int)a[1], (int)a[2]}, n > 3 ? (int)a[3] : 255);
+      break;
+    case BATCH_COLOR1:
+      pixelColor1 = {(int)a[0], (int)a[1], (int)a[2]};
+      break;
+    case BATCH_COLOR2:
+      pixelColor2 = {(int)a[0], (int)a[1], (int)a[2]};
+      break;
+    case BATCH_ALPHA1:
+      alphaChannel1 = (int)a[0];
+      break;
+    case BATCH_ALPHA2:
+      alphaChannel2 = (int)a[0];
+      break;
+    case BATCH_LINE_WIDTH:
+      lineWidth = (int)a[0];
+      break;
+    case BATCH_LINE_PATTERN:
+      linePattern = (uint32_t)(int64_t)a[0];
+      break;
+    case BATCH_FILL_PATTERN:
+      fillPattern.clear();
+      for (i = 0; i < n; i++)
+        fillPattern.push_back((uint32_t)(int64_t)a[i]);
+      break;
+    case BATCH_ANTI_ALIAS:
+      antiAlias = (int)a[0];
+      break;
+    case BATCH_CURVE_TOLERANCE:
+      curveTolerance = a[0];
+      break;
+    case BATCH_STAMP_CACHE:
+      SetStampCacheLimit((size_t)a[0]);
+      break;
+    case BATCH_PIXEL:
+      DrawPixel(a[0], a[1]);
+      break;
+    case BATCH_LINE:
+      DrawLine(a[0], a[1], a[2], a[3], n > 4 ? (int)a[4] : 0);
+      break;
+    case BATCH_RECT:
+      DrawRect(a[0], a[1], a[2], a[3]);
+      break;
+    case BATCH_BOX:
+      DrawBox(a[0], a[1], a[2], a[3]);
+      break;
+    case BATCH_POLY:
+    case BATCH_FILLED_POLY:
+      worker->coords.clear();
+      for (i = 0; i < n; i += 2)
+        worker->coords.push_back(std::make_pair((int)a[i], (int)a[i + 1]));
+      if (command->op == BATCH_POLY)
+        DrawPoly(&worker->coords);
+      else
+        DrawFilledPoly(&worker->coords);
+      break;
+    case BATCH_ELLIPSE:
+      DrawEllipse(a[0], a[1], a[2], a[3], n > 4 ? (int)a[4] : -1, n > 4 ? (int)a[5] : -1, n > 6 ? (int)a[6] : 0);
+      break;
+    case BATCH_PIE:
+      DrawPie(a[0], a[1], a[2], a[3], n > 4 ? (int)a[4] : -1, n > 4 ? (int)a[5] : -1);
+      break;
+    case BATCH_BEZIER:
+      if (n == 6)
+        DrawBezier(a[0], a[1], a[2], a[3], a[4], a[5]);
+      else
+        DrawBezier(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+      break;
+    case BATCH_PATH:
+    case BATCH_FILLED_PATH:
+      if (buildBatchPath(worker, &*command))
+        return batchError(command->line, "malformed path");
+      if (command->op == BATCH_PATH)
+        DrawPath(&worker->path);
+      else
+        DrawFilledPath(&worker->path);
+      break;
+    case BATCH_MARKERS:
+      worker->points.clear();
+      for (i = 2; i < n; i++)
+        worker->points.push_back((int)a[i]);
+      DrawMarkers(worker->points.data(), (n - 2) / 2, (MarkerShape)(int)a[0], (int)a[1]);
+      break;
+    case BATCH_GEOMETRY:
+      worker->word.assign(text + command->word, command->wordLen);
+      file = OpenGeometryFile(worker->word.c_str());
+      if (file == NULL)
+        return batchError(command->line, "cannot open geometry file");
+      DrawGeometryFile(file, n > 0 && a[0] != 0);
+      CloseGeometryFile(file);
+      break;
+    }
+  }
+
+  return 0;
 }
 
-// Subprocess to initializes edge table from polygon coordinate list
-void initEdgeTable(Edge **edgeTable, TImageCoordList *coordList)
+// Subprocess that parses, renders and writes one batch image, timing every stage
+int runBatchJob(const char *text, BatchWorker *worker, BatchJob *job, const DrawState *defaults, double defaultTolerance,
+                size_t defaultStampCache)
 {
-  int y1, y2, yPrev, yNext;
-  TImageCoordList::iterator current = coordList->end();
-  current--;
-  current--;
-  yPrev = current->second;
-  current++;
-  TImageCoordList::iterator next = coordList->begin();
-  TImageCoordList::iterator next2 = coordList->begin();
-  next2++;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(), stage;
+  BatchCommand *image;
+  Image *framebuffer = worker->image;
+  int width, height, channels, rc;
+  FILE *out;
 
-  while (next != coordList->end())
-  {
-    y1 = current->second;
-    y2 = next->second;
+  rc = parseBatchJob(text, worker, job);
+  stage = std::chrono::steady_clock::now();
+  job->parseTime = std::chrono::duration<double>(stage - start).count();
+  if (rc)
+    return -1;
 
-    yNext = next2->second;
+  // Reshape the framebuffer in place, it was allocated for the largest image of the batch
+  if (worker->commands.empty() || worker->commands[0].op != BATCH_IMAGE)
+    return batchError(job->line, "image expected");
+  image = &worker->commands[0];
+  width = (int)worker->args[image->arg];
+  height = (int)worker->args[image->arg + 1];
+  channels = image->wordLen > 4 && !strncmp(text + image->word + image->wordLen - 4, ".ppm", 4) ? 3 : 4;
+  if (width <= 0 || height <= 0)
+    return batchError(image->line, "bad image size");
+  framebuffer->target.width = width;
+  framebuffer->target.height = height;
+  framebuffer->channels = channels;
+  framebuffer->stride = (size_t)width * channels;
+  clearBatchImage(framebuffer, {0, 0, 0}, 0);
 
-    if (++next2 == coordList->end())
-      next2 = coordList->begin();
+  // Every image starts from the same state whichever worker draws it
+  ApplyDrawState(defaults);
+  curveTolerance = defaultTolerance;
+  SetStampCacheLimit(defaultStampCache);
+  renderTarget = &framebuffer->target;
 
-    if (y1 <= y2)
-    {
-      insertEdge(&edgeTable[y1], createEdge(*current, *next, yNext));
-    }
-    else
-    {
-      insertEdge(&edgeTable[y2], createEdge(*next, *current, yPrev));
-    }
+  start = stage;
+  rc = renderBatchJob(text, worker);
+  stage = std::chrono::steady_clock::now();
+  job->renderTime = std::chrono::duration<double>(stage - start).count();
+  if (rc)
+    return -1;
 
-    DrawLine(current->first, y1, next->first, y2);
+  start = stage;
+  worker->word.assign(text + image->word, image->wordLen);
+  out = fopen(worker->word.c_str(), "wb");
+  if (out == NULL)
+    return batchError(image->line, "cannot open output file");
+  rc = WriteImage(framebuffer, out);
+  if (fclose(out))
+    rc = -1;
+  job->writeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (rc)
+    return batchError(image->line, "cannot write output file");
 
-    yPrev = y1;
-    current = next;
-    next++;
-  }
+  return 0;
 }
 
-// Subprocess that inserts to active edge list
-void insertActiveList(Edge **ptrHead, Edge **activeList)
+// Subprocess run by every batch render thread, takes the next image until none are left
+void RunBatchWorker(const std::string *text, std::vector<BatchJob> *jobs, std::atomic<size_t> *next, int width, int height,
+                    const DrawState *defaults, double defaultTolerance, size_t defaultStampCache, int markers)
 {
-  Edge *ptr = NULL;
-  Edge *current = *ptrHead;
+  BatchWorker worker;
+  size_t i;
 
-  while (current != NULL)
-  {
-    ptr = current->next;
-    insertEdge(activeList, current);
-    current = ptr;
-  }
+  markerThreads = markers;
+  worker.image = CreateImage(width, height, 4);
+  while ((i = (*next)++) < jobs->size())
+    if (worker.image == NULL || runBatchJob(text->c_str(), &worker, &(*jobs)[i], defaults, defaultTolerance, defaultStampCache))
+      (*jobs)[i].failed = 1;
+
+  ClearStampCache();
+  FreeImage(worker.image);
 }
 
-// Subprocess that scan-fills given line from active list
-void scanFill(int scan, Edge *activeList, u_int32_t *pattern)
+// Subprocess that returns a percentile of stage times in milliseconds, sorting them in place
+double batchPercentile(std::vector<double> *times, double percentile)
 {
-  int x, startx, endx, off, pixelFlag, count = 0;
-  Edge *current = activeList, *next;
-  uint32_t tempPattern = *pattern;
+  if (times->empty())
+    return 0;
 
-  while (current->next != NULL)
-  {
-    count++;
-    if (current->yMax == scan)
-      count++;
+  std::sort(times->begin(), times->end());
+  return 1000 * (*times)[min((size_t)(percentile / 100 * times->size()), times->size() - 1)];
+}
 
-    next = current->next;
+// Interface to render a batch of images from a command file ("-" reads stdin) on worker threads without a window,
+// returns the number of images that failed or -1 if the batch could not be read
+int RunBatch(const char *path, int threads = 0)
+{
+  std::string text;
+  std::vector<BatchJob> jobs;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> next(0);
+  std::chrono::steady_clock::time_point start;
+  DrawState defaults;
+  BatchJob job = {0, 0, 0, 0, 0, 0, 0};
+  size_t pos, lineEnd;
+  char buffer[1 << 16];
+  int line, kind, width, height, maxWidth = 1, maxHeight = 1, failed = 0, markers = markerThreads;
+  double splitTime, elapsed;
 
-    for (off = 0; off < (int)current->dx % 32; off++)
-    {
-      pixelFlag = GetAndRotatePixelFlag(pattern);
-    }
-    if (count & 1)
+  FILE *in = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+  if (in == NULL)
+  {
+    fprintf(stderr, "cannot open batch file %s\n", path);
+    return -1;
+  }
+  while ((pos = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    text.append(buffer, pos);
+  if (in != stdin)
+    fclose(in);
+
+  // Every image command starts a new image, the largest one sizes the framebuffers
+  start = std::chrono::steady_clock::now();
+  for (pos = 0, line = 1; pos < text.size(); pos = lineEnd + 1, line++)
+  {
+    lineEnd = text.find('\n', pos);
+    if (lineEnd == std::string::npos)
+      lineEnd = text.size();
+    kind = scanBatchLine(text.c_str() + pos, text.c_str() + lineEnd, &width, &height);
+    if (kind == 1)
     {
-      startx = current->dx + (lineWidth >> 2) + 1;
-      endx = next->dx - ((lineWidth - 1) >> 2) + 1;
-      for (x = startx; x < endx; x++)
-      {
-        pixelFlag = GetAndRotatePixelFlag(pattern);
-        if (pixelFlag)
-          DrawPixel(x, scan, pixelColor2, alphaChannel2);
-      }
+      if (!jobs.empty())
+        jobs.back().end = pos;
+      job.begin = pos;
+      job.line = line;
+      jobs.push_back(job);
+      maxWidth = max(maxWidth, width);
+      maxHeight = max(maxHeight, height);
     }
-    *pattern = tempPattern;
-    current = current->next;
+    else if (kind == 2 && jobs.empty())
+      return batchError(line, "drawing before the first image");
   }
-}
+  if (jobs.empty())
+    return 0;
+  jobs.back().end = text.size();
+  splitTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-// Subprocess that updates active edge list values with each scan line
-void updateActiveList(int scan, Edge **activeList)
-{
-  Edge *current, *next, *prev = NULL;
+  threads = threads > 0 ? threads : (int)std::thread::hardware_concurrency();
+  threads = max(1, min(threads, (int)jobs.size()));
 
-  for (current = *activeList; current != NULL; current = next)
-  {
-    next = current->next;
+  // Images are already drawn in parallel, so markers stay on their image's thread
+  if (threads > 1 && markers == 0)
+    markers = 1;
 
-    if (current->yMax > scan)
+  CaptureDrawState(&defaults);
+  start = std::chrono::steady_clock::now();
+  for (int t = 0; t < threads; t++)
+    workers.push_back(std::thread(RunBatchWorker, &text, &jobs, &next, maxWidth, maxHeight, &defaults, curveTolerance,
+                                  stampCacheLimit, markers));
+  for (std::vector<std::thread>::iterator worker = workers.begin(); worker != workers.end(); worker++)
+    worker->join();
+  elapsed = splitTime + std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Throughput and per stage latency percentiles of the images that made it through
+  std::vector<double> stages[4];
+  for (std::vector<BatchJob>::iterator iter = jobs.begin(); iter != jobs.end(); iter++)
+  {
+    if (iter->failed)
     {
-      current->dx += current->slope;
-      prev = current;
+      failed++;
       continue;
     }
+    stages[0].push_back(iter->parseTime);
+    stages[1].push_back(iter->renderTime);
+    stages[2].push_back(iter->writeTime);
+    stages[3].push_back(iter->parseTime + iter->renderTime + iter->writeTime);
+  }
 
-    if (prev != NULL)
-      prev->next = next;
-    else
-      *activeList = next;
+  const char *names[] = {"parse", "render", "write", "total"};
+  printf("%d images in %.3f s on %d threads, %.1f images/s, %d failed\n", (int)jobs.size(), elapsed, threads,
+         (jobs.size() - failed) / elapsed, failed);
+  printf("split  %9.3f ms for the whole batch\n", 1000 * splitTime);
+  printf("stage     p50 ms    p90 ms    p99 ms    max ms\n");
+  for (int i = 0; i < 4; i++)
+    printf("%-6s %9.3f %9.3f %9.3f %9.3f\n", names[i], batchPercentile(&stages[i], 50), batchPercentile(&stages[i], 90),
+           batchPercentile(&stages[i], 99), batchPercentile(&stages[i], 100));
 
-    free(current);
-  }
+  return failed;
 }
 
-// Subprocess that resorts active edge list
-void resortActiveList(Edge **activeList)
+// Subprocess that draws a seeded mix of lines, polygons, ellipses and pies for the anti-aliasing benchmark, scaled up for supersampling
+void drawBenchShapes(int count, int scale)
 {
-  Edge *current = *activeList, *next;
-  *activeList = NULL;
-  while (current != NULL)
+  TImageCoordList coordList;
+  int i, j, x, y;
+
+  srand(1);
+  lineWidth = 2 * scale;
+  for (i = 0; i < count; i++)
   {
-    next = current->next;
-    insertEdge(activeList, current);
-    current = next;
+    x = rand() % winw;
+    y = rand() % winh;
+    switch (i & 3)
+    {
+    case 0:
+      DrawLine(x * scale, y * scale, (x + rand() % 400 - 200) * scale, (y + rand() % 400 - 200) * scale);
+      break;
+    case 1:
+      coordList.clear();
+      for (j = 0; j < 5; j++)
+        coordList.push_back(std::make_pair((x + rand() % 200 - 100) * scale, (y + rand() % 200 - 100) * scale));
+      DrawFilledPoly(&coordList);
+      DrawPoly(&coordList);
+      break;
+    case 2:
+      DrawEllipse(x * scale, y * scale, (rand() % 100 + 2) * scale, (rand() % 100 + 2) * scale);
+      break;
+    case 3:
+      j = rand() % 360;
+      DrawPie(x * scale, y * scale, (rand() % 60 + 2) * scale, (rand() % 60 + 2) * scale, j, (j + rand() % 300 + 30) % 360);
+      break;
+    }
   }
 }
 
-// Interface to draw filled closed polygons
-void DrawFilledPoly(TImageCoordList *coordList)
+// Subprocess that box filters an image down to half its size
+void downsampleImage(Image *src, Image *dst)
 {
-  int i, scan, canvasX, canvasY;
-  if (GetCanvasSize(&canvasX, &canvasY))
-    return;
+  uint8_t *a, *b, *px;
+  int x, y, c;
 
-  Edge **edgeTable = (Edge **)malloc(sizeof(Edge *) * canvasY);
+  for (y = 0; y < dst->target.height; y++)
+  {
+    a = src->pixels + (size_t)(2 * y) * src->stride;
+    b = a + src->stride;
+    px = dst->pixels + (size_t)y * dst->stride;
+    for (x = 0; x < dst->target.width; x++, a += 2 * src->channels, b += 2 * src->channels, px += dst->channels)
+      for (c = 0; c < dst->channels; c++)
+        px[c] = (a[c] + a[c + src->channels] + b[c] + b[c + src->channels] + 2) >> 2;
+  }
+}
 
-  std::deque<uint32_t>::iterator patternIter;
-  patternIter = fillPattern.begin();
-  uint32_t tempPattern;
+// Interface to time aliased, analytic anti-aliased and 4x supersampled drawing of the same shapes on headless images
+int BenchAntiAlias(int count = 4000)
+{
+  Image *image = CreateImage(winw, winh);
+  Image *large = CreateImage(2 * winw, 2 * winh);
+  RenderTarget *oldTarget = renderTarget;
+  int oldAntiAlias = antiAlias, oldLineWidth = lineWidth;
+  uint32_t oldLinePattern = linePattern;
+  std::deque<uint32_t> oldFillPattern = fillPattern;
+  std::chrono::steady_clock::time_point start;
+  double aliased, analytic, supersampled;
 
-  for (i = 0; i < canvasY; i++)
+  if (image == NULL || large == NULL)
   {
-    edgeTable[i] = NULL;
+    if (image != NULL)
+      FreeImage(image);
+    if (large != NULL)
+      FreeImage(large);
+    return -1;
   }
 
-  initEdgeTable(edgeTable, coordList);
+  // Solid patterns so every mode covers the same shapes
+  linePattern = 0xFFFFFFFFU;
+  fillPattern = {0xFFFFFFFFU};
 
-  Edge *activeList = (Edge *)malloc(sizeof(Edge *));
-  activeList = NULL;
+  renderTarget = &image->target;
+  antiAlias = 0;
+  start = std::chrono::steady_clock::now();
+  drawBenchShapes(count, 1);
+  aliased = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-  // Scan line loop
-  for (scan = 0; scan < canvasY; scan++)
-  {
-    tempPattern = *patternIter;
-    insertActiveList(&edgeTable[scan], &activeList);
-    if (activeList != NULL)
-    {
-      scanFill(scan, activeList, &*patternIter);
-      updateActiveList(scan, &activeList);
-      resortActiveList(&activeList);
-    }
+  memset(image->pixels, 0, (size_t)image->stride * image->target.height);
+  antiAlias = 1;
+  start = std::chrono::steady_clock::now();
+  drawBenchShapes(count, 1);
+  analytic = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    // Reset current line of fill pattern to avoid gradual drift
-    *patternIter = tempPattern;
-    // Loop fill pattern
-    if (patternIter != fillPattern.end())
-      patternIter++;
-    else
-      patternIter = fillPattern.begin();
-  }
+  // Supersampling draws at twice the size in both directions and filters down
+  renderTarget = &large->target;
+  antiAlias = 0;
+  start = std::chrono::steady_clock::now();
+  drawBenchShapes(count, 2);
+  downsampleImage(large, image);
+  supersampled = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-  // Finally free the list heads (the vertices are freed during the scan line process)
-  free(edgeTable);
-  free(activeList);
+  printf("%d shapes on %dx%d\n", count, winw, winh);
+  printf("aliased          %8.3f s\n", aliased);
+  printf("analytic AA      %8.3f s  %.2fx aliased\n", analytic, analytic / aliased);
+  printf("4x supersampling %8.3f s  %.2fx aliased, %.2fx analytic AA\n", supersampled, supersampled / aliased, supersampled / analytic);
+
+  renderTarget = oldTarget;
+  antiAlias = oldAntiAlias;
+  lineWidth = oldLineWidth;
+  linePattern = oldLinePattern;
+  fillPattern = oldFillPattern;
+  FreeImage(image);
+  FreeImage(large);
+  return 0;
 }
 
-// Subprocess that draws a basic 1px thick full ellipse using midpoint algorithm
-void DrawBasicEllipse(int x, int y, int rx, int ry)
+// Golden image corpus, every shape class is drawn at every line width, pattern pair and anti-aliasing mode
+const char *goldenClasses[] = {"line", "rect", "box", "poly", "fill", "ellipse", "pie"};
+const int goldenWidths[] = {1, 2, 3, 4, 7, 12};
+const uint32_t goldenLinePatterns[] = {0xFFFFFFFFU, 0xFFF00FFFU, 0xAAAAAAAAU, 0x80000001U};
+const std::deque<uint32_t> goldenFillPatterns[] = {{0xFFFFFFFFU},
+                                                    {0x00F00F00U, 0x0FFFFFF0U, 0x00FFFF00U, 0x000FF000U, 0x00000000U},
+                                                    {0xAAAAAAAAU, 0x55555555U},
+                                                    {0xF0F0F0F0U, 0x0F0F0F0FU, 0x00000000U}};
+
+// Subprocess that returns the 64-bit FNV-1a hash of a string or pixel buffer
+uint64_t fnvHash(const uint8_t *data, size_t length, uint64_t hash = 0xCBF29CE484222325ULL)
 {
-  int a = 2 * rx;
-  int b = 2 * ry;
-  int b1 = b & 1;
-  long long dx = 4 * (1 - a) * b * b;
-  long long dy = 4 * (b1 + 1) * a * a;
-  long long err = dx + dy + b1 * a * a;
-  long long err2;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ data[i]) * 0x100000001B3ULL;
+  return hash;
+}
 
-  int x0 = x - rx;
-  int y0 = y - ry + (b + 1) / 2;
-  int x1 = x + rx;
-  int y1 = y0;
-  a *= 8 * a;
-  b1 = 8 * b * b;
+// Subprocess that draws one seeded random shape of a golden class, line directions sweep the full circle over a case
+void drawGoldenShape(int kind, int index)
+{
+  TImageCoordList coordList;
+  int x, y, dx, dy, rx, ry, a1, a2, flag, points, j;
+  double angle;
 
-  int pixelFlag;
-  uint32_t pattern = linePattern;
+  // Colors and alpha change with every shape so blending is covered too, one shape in three is translucent
+  pixelColor1.red = rand() % 256;
+  pixelColor1.green = rand() % 256;
+  pixelColor1.blue = rand() % 256;
+  pixelColor2.red = rand() % 256;
+  pixelColor2.green = rand() % 256;
+  pixelColor2.blue = rand() % 256;
+  alphaChannel1 = rand() % 3 ? 255 : rand() % 255 + 1;
+  alphaChannel2 = rand() % 3 ? 255 : rand() % 255 + 1;
 
-  do
-  {
-    pixelFlag = GetAndRotatePixelFlag(&pattern);
-    if (pixelFlag)
-    {
-      DrawPixel(x1, y0, pixelColor1, alphaChannel1);
-      DrawPixel(x0, y0, pixelColor1, alphaChannel1);
-      DrawPixel(x0, y1, pixelColor1, alphaChannel1);
-      DrawPixel(x1, y1, pixelColor1, alphaChannel1);
-    }
-    err2 = 2 * err;
-    if (err2 <= dy)
-    {
-      y0++;
-      y1--;
-      dy += a;
-      err += dy;
-    }
-    if (err2 >= dx || 2 * err > dy)
-    {
-      x0++;
-      x1--;
-      dx += b1;
-      err += dx;
-    }
-  } while (x0 <= x1);
+  // Shapes may stick out of the canvas to cover clipping
+  x = rand() % (GOLDEN_SIZE + 64) - 32;
+  y = rand() % (GOLDEN_SIZE + 64) - 32;
+  rx = rand() % 96 + 1;
+  ry = rand() % 96 + 1;
+  a1 = rand() % 4 ? rand() % 360 : -1;
+  a2 = a1 < 0 ? -1 : rand() % 360;
+  flag = rand() & 1;
 
-  while (y0 - y1 < b)
+  switch (kind)
   {
-    pixelFlag = GetAndRotatePixelFlag(&pattern);
-    if (pixelFlag)
+  case 0:
+    angle = (index * 360.0 / GOLDEN_SHAPES + rand() % 15) * M_PI / 180;
+    DrawLine(x, y, x + (int)lround(2 * rx * cos(angle)), y + (int)lround(2 * rx * sin(angle)), flag);
+    break;
+  case 1:
+  case 2:
+    dx = rand() % 160 - 80;
+    dy = rand() % 160 - 80;
+    if (kind == 1)
+      DrawRect(x, y, x + dx, y + dy);
+    else
+      DrawBox(x, y, x + dx, y + dy);
+    break;
+  case 3:
+  case 4:
+    points = rand() % 6 + 3;
+    for (j = 0; j < points; j++)
     {
-      DrawPixel(x0 - 1, y0, pixelColor1, alphaChannel1);
-      DrawPixel(x1 + 1, y0, pixelColor1, alphaChannel1);
-      DrawPixel(x0 - 1, y1, pixelColor1, alphaChannel1);
-      DrawPixel(x1 + 1, y1, pixelColor1, alphaChannel1);
+      dx = rand() % 160 - 80;
+      dy = rand() % 160 - 80;
+      coordList.push_back(std::make_pair(x + dx, y + dy));
     }
-    y0++;
-    y1--;
+    if (kind == 3)
+      DrawPoly(&coordList);
+    else
+      DrawFilledPoly(&coordList);
+    break;
+  case 5:
+    DrawEllipse(x, y, rx, ry, a1, a2, flag);
+    break;
+  case 6:
+    DrawPie(x, y, rx, ry, a1, a2);
+    break;
   }
 }
 
-// Subprocess that draws a basic 1px thick elliptical arc using slower trigonometric algorithm in the clockwise direction
-void DrawPartialEllipse(int x, int y, int rx, int ry, int a1, int a2)
+// Subprocess that draws ellipses and pies at the canvas edge and inside it with and without the stamp cache, so stamps
+// recorded at one center are replayed at the others, returns the number of cases where the two differ
+int checkGoldenStamps(Image *image)
 {
-  int dx, dy, lx, ly, a;
-  int pixelFlag;
-  uint32_t pattern = linePattern;
+  const int centers[] = {10, 10, GOLDEN_SIZE / 2, GOLDEN_SIZE / 2, 3, GOLDEN_SIZE - 3, GOLDEN_SIZE / 2, 5, 40, 90};
+  const int widths = sizeof(goldenWidths) / sizeof(goldenWidths[0]);
+  const int patterns = sizeof(goldenLinePatterns) / sizeof(goldenLinePatterns[0]);
+  size_t oldLimit = stampCacheLimit;
+  uint64_t hashes[2];
+  char name[64];
+  int kind, w, p, cached, i, c, rx, ry, a1, a2, failed = 0;
 
-  lx = rx * cos(a1 * M_PI / 180);
-  ly = ry * sin(a1 * M_PI / 180);
+  for (kind = 0; kind < 2; kind++)
+    for (w = 0; w < widths; w++)
+      for (p = 0; p < patterns; p++)
+      {
+        snprintf(name, sizeof(name), "stamp-%s-w%d-p%d", kind ? "pie" : "ellipse", goldenWidths[w], p);
+        for (cached = 0; cached < 2; cached++)
+        {
+          ClearStampCache();
+          SetStampCacheLimit(cached ? 1 << 24 : 0);
+          memset(image->pixels, 0, (size_t)image->stride * image->target.height);
+          lineWidth = goldenWidths[w];
+          linePattern = goldenLinePatterns[p];
+          fillPattern = goldenFillPatterns[p];
+          antiAlias = 0;
 
-  for (a = a1 + 1; a <= a2; a++)
-  {
-    dx = rx * cos(a * M_PI / 180.00);
-    dy = ry * sin(a * M_PI / 180.00);
-    pixelFlag = GetAndRotatePixelFlag(&pattern);
-    if (pixelFlag)
-      DrawBasicLine(x + lx, y + ly, x + dx, y + dy);
-    lx = dx;
-    ly = dy;
-  }
+          srand((unsigned)fnvHash((const uint8_t *)name, strlen(name)));
+          for (i = 0; i < GOLDEN_SHAPES / 4; i++)
+          {
+            rx = rand() % 48 + 1;
+            ry = rand() % 48 + 1;
+            a1 = rand() % 2 ? rand() % 360 : -1;
+            a2 = a1 < 0 ? -1 : rand() % 360;
+            pixelColor1.red = pixelColor2.green = rand() % 256;
+            alphaChannel1 = alphaChannel2 = rand() % 2 ? 255 : 128;
+            for (c = 0; c < (int)(sizeof(centers) / sizeof(centers[0])); c += 2)
+              if (kind)
+                DrawPie(centers[c], centers[c + 1], rx, ry, a1, a2);
+              else
+                DrawEllipse(centers[c], centers[c + 1], rx, ry, a1, a2);
+          }
+          hashes[cached] = fnvHash(image->pixels, (size_t)image->stride * image->target.height);
+        }
+        if (hashes[0] != hashes[1])
+        {
+          printf("%s cached stamps differ from direct drawing\n", name);
+          failed++;
+        }
+      }
+
+  ClearStampCache();
+  SetStampCacheLimit(oldLimit);
+  return failed;
 }
 
-// Interface to draw empty full ellipses and ellipse sectors in the clockwise direction
-void DrawEllipse(int x, int y, int rx, int ry, int a1 = -1, int a2 = -1, int radii = 0)
+// Interface to render the seeded golden corpus headless and check every case against the hashes stored in a golden
+// file, and every shape class against the throughput stored in an optional rates file. With update set both files are
+// recorded from this run, a missing rates file is always recorded as rates only hold for the machine that measured them.
+// Returns the number of failed checks or -1 if a file cannot be read or written
+int RunGolden(const char *path, int update = 0, const char *ratesPath = NULL, double slowdown = 0.25)
 {
-  // Handling for full ellipse
-  if ((a1 < 0 && a2 < 0) || (a1 == a2))
+  const int classes = sizeof(goldenClasses) / sizeof(goldenClasses[0]);
+  const int widths = sizeof(goldenWidths) / sizeof(goldenWidths[0]);
+  const int patterns = sizeof(goldenLinePatterns) / sizeof(goldenLinePatterns[0]);
+  std::map<std::string, uint64_t> goldenHashes;
+  std::map<std::string, double> goldenRates;
+  std::vector<std::string> names;
+  std::vector<uint64_t> hashes;
+  std::chrono::steady_clock::time_point start;
+  double classTime[classes], roundTime, rate, goldenRate;
+  char line[256], name[128];
+  unsigned long long hash;
+  int kind, w, p, aa, i, round, caseIndex, failed = 0, unstable = 0, updateRates = update && ratesPath != NULL;
+  Image *image;
+  RenderTarget *oldTarget = renderTarget;
+  DrawState oldState;
+  FILE *file;
+
+  // Stored hashes must exist unless they are being recorded, a check against nothing would always pass
+  if (!update)
   {
-    // Handling line width
-    for (int i = 1; i <= lineWidth; i++)
+    file = fopen(path, "r");
+    if (file == NULL)
     {
-      // Odd goes under
-      if (i & 1)
-        DrawBasicEllipse(x, y, rx - ((i - 1) >> 1), ry - ((i - 1) >> 1));
-      // Even goes over
-      else
-        DrawBasicEllipse(x, y, rx + (i >> 1), ry + (i >> 1));
+      fprintf(stderr, "cannot read golden file %s, record it with --update\n", path);
+      return -1;
     }
+    while (fgets(line, sizeof(line), file) != NULL)
+      if (sscanf(line, "case %127s %llx", name, &hash) == 2)
+        goldenHashes[name] = hash;
+    fclose(file);
   }
-  else
-  // Handling for elliptical arcs and sectors
+
+  file = ratesPath != NULL && !update ? fopen(ratesPath, "r") : NULL;
+  if (file != NULL)
   {
-    int ta1 = max(a1, 0);
-    int ta2 = min(a2, 360);
-    int ta3 = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+      if (sscanf(line, "rate %127s %lf", name, &rate) == 2)
+        goldenRates[name] = rate;
+    fclose(file);
+  }
+  else if (ratesPath != NULL)
+    updateRates = 1;
 
-    // Break down into 2 arcs if a1 > a2 to preserve directionality
-    if (ta1 > ta2)
-    {
-      ta3 = ta1;
-      ta1 = 0;
-    }
+  image = CreateImage(GOLDEN_SIZE, GOLDEN_SIZE);
+  if (image == NULL)
+    return -1;
+  CaptureDrawState(&oldState);
+  renderTarget = &image->target;
 
-    // Handling line width
-    for (int i = 1; i <= lineWidth; i++)
+  // Every round draws the whole corpus, the first one hashes and later ones must reproduce it
+  for (kind = 0; kind < classes; kind++)
+    classTime[kind] = 1e30;
+  for (round = 0; round < GOLDEN_ROUNDS; round++)
+  {
+    caseIndex = 0;
+    for (kind = 0; kind < classes; kind++)
     {
-      // Odd goes under
-      if (i & 1)
-        DrawPartialEllipse(x, y, rx - ((i - 1) >> 1), ry - ((i - 1) >> 1), ta1, ta2);
-      // Even goes over
-      else
-        DrawPartialEllipse(x, y, rx + (i >> 1), ry + (i >> 1), ta1, ta2);
-    }
+      roundTime = 0;
+      for (w = 0; w < widths; w++)
+        for (p = 0; p < patterns; p++)
+          for (aa = 0; aa < 2; aa++, caseIndex++)
+          {
+            snprintf(name, sizeof(name), "%s-w%d-p%d-aa%d", goldenClasses[kind], goldenWidths[w], p, aa);
+            memset(image->pixels, 0, (size_t)image->stride * image->target.height);
+            lineWidth = goldenWidths[w];
+            linePattern = goldenLinePatterns[p];
+            fillPattern = goldenFillPatterns[p];
+            antiAlias = aa;
 
-    // Draw second part of arc if it loops past start
-    if (ta3)
-    {
-      // Handling line width
-      for (int i = 1; i <= lineWidth; i++)
-      {
-        // Odd goes under
-        if (i & 1)
-          DrawPartialEllipse(x, y, rx - ((i - 1) >> 1), ry - ((i - 1) >> 1), ta3, 360);
-        // Even goes over
-        else
-          DrawPartialEllipse(x, y, rx + (i >> 1), ry + (i >> 1), ta3, 360);
-      }
-    }
+            // Each case has its own seed so adding cases leaves the others alone
+            srand((unsigned)fnvHash((const uint8_t *)name, strlen(name)));
+            start = std::chrono::steady_clock::now();
+            for (i = 0; i < GOLDEN_SHAPES; i++)
+              drawGoldenShape(kind, i);
+            roundTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    // Draw radius lines to close sector
-    if (radii)
-    {
-      DrawLine(x, y, x + cos(a1 * M_PI / 180) * rx, y + sin(a1 * M_PI / 180) * ry);
-      DrawLine(x, y, x + cos(a2 * M_PI / 180) * rx, y + sin(a2 * M_PI / 180) * ry);
+            hash = fnvHash(image->pixels, (size_t)image->stride * image->target.height);
+            if (round == 0)
+            {
+              names.push_back(name);
+              hashes.push_back(hash);
+
+              // Changed cases are written out next to the golden file to compare with images from a known good build
+              if (!update && (!goldenHashes.count(name) || goldenHashes[name] != hash))
+              {
+                snprintf(line, sizeof(line), "%s.%s.pam", path, name);
+                file = fopen(line, "wb");
+                if (file != NULL)
+                {
+                  WriteImage(image, file);
+                  fclose(file);
+                }
+              }
+            }
+            else if (hashes[caseIndex] != hash)
+              unstable++;
+          }
+      classTime[kind] = min(classTime[kind], roundTime);
     }
   }
-}
 
-// Subprocess that draws a filled ellipse or ellipse sector
-void DrawBasicPie(int x, int y, int rx, int ry, int a1, int a2)
-{
-  int scanx, scany, yy;
-  long rx2 = rx * rx;
-  long ry2 = ry * ry;
-  long rxry = rx2 * ry2;
-  long p;
-  int a = a2 - a1;
-  double ra1 = a1 * M_PI / 180;
-  double ra2 = a2 * M_PI / 180;
-  int a1x = rx * cos(ra1);
-  int a1y = ry * sin(ra1);
-  int a2x = rx * cos(ra2);
-  int a2y = ry * sin(ra2);
+  failed += checkGoldenStamps(image);
+  ApplyDrawState(&oldState);
+  renderTarget = oldTarget;
+  FreeImage(image);
 
-  int pixelFlag;
-  std::deque<uint32_t>::iterator patternIter;
-  patternIter = fillPattern.begin();
-  uint32_t tempPattern;
+  if (unstable)
+  {
+    printf("%d cases rendered differently between rounds\n", unstable);
+    failed += unstable;
+  }
 
-  // Handling for sectors wider than 180°
-  if (a < 180)
+  if (update)
   {
-    for (scany = -ry; scany <= ry; scany++)
+    file = fopen(path, "w");
+    if (file == NULL)
     {
-      // Use temp pattern to avoid gradual drift of original line pattern
-      tempPattern = *patternIter;
-      yy = scany * scany;
-      for (scanx = -rx; scanx <= rx; scanx++)
-      {
-        pixelFlag = GetAndRotatePixelFlag(&tempPattern);
-        p = scanx * scanx * ry2 + yy * rx2;
-        if (pixelFlag && p < rxry)
-          if (scanx * a1y - scany * a1x <= 0 && scanx * a2y - scany * a2x > 0)
-            DrawPixel(x + scanx, y + scany, pixelColor2, alphaChannel2);
-      }
-
-      // Reset current line of fill pattern to avoid gradual drift
-      *patternIter = tempPattern;
-      // Loop fill pattern
-      if (patternIter != fillPattern.end())
-        patternIter++;
-      else
-        patternIter = fillPattern.begin();
+      fprintf(stderr, "cannot write golden file %s\n", path);
+      return -1;
     }
+    fprintf(file, "# golden corpus: %d shapes per case on %dx%d, FNV-1a hashes of the RGBA pixels\n", GOLDEN_SHAPES,
+            GOLDEN_SIZE, GOLDEN_SIZE);
+    for (i = 0; i < (int)names.size(); i++)
+      fprintf(file, "case %s %016llx\n", names[i].c_str(), (unsigned long long)hashes[i]);
+    fclose(file);
+    printf("recorded %d cases to %s\n", (int)names.size(), path);
   }
-  // Handling for smaller sectors
   else
   {
-    for (scany = -ry; scany <= ry; scany++)
+    for (i = 0; i < (int)names.size(); i++)
     {
-      tempPattern = *patternIter;
-      yy = scany * scany;
-      for (scanx = -rx; scanx <= rx; scanx++)
-      {
-        pixelFlag = GetAndRotatePixelFlag(&*patternIter);
-        p = scanx * scanx * ry2 + yy * rx2;
-        if (pixelFlag && p < rxry)
-          if (scanx * a1y - scany * a1x <= 0 || scanx * a2y - scany * a2x > 0)
-            DrawPixel(x + scanx, y + scany, pixelColor2, alphaChannel2);
-      }
-
-      // Reset current line of fill pattern to avoid gradual drift
-      *patternIter = tempPattern;
-      // Loop fill pattern
-      if (patternIter != fillPattern.end())
-        patternIter++;
-      else
-        patternIter = fillPattern.begin();
+      if (goldenHashes.count(names[i]) && goldenHashes[names[i]] == hashes[i])
+        continue;
+      printf("%s %s\n", names[i].c_str(), goldenHashes.count(names[i]) ? "changed" : "missing from golden file");
+      failed++;
     }
   }
-}
 
-// Interface for pies and pie sectors
-void DrawPie(int x, int y, int rx, int ry, int a1 = -1, int a2 = -1)
-{
-  // Correction for width of line
-  int widthCor = (lineWidth >> 1);
-  int ta1 = max(a1, 0);
-  int ta2 = a2 < 0 ? 360 : min(a2, 360);
-  int ta3 = 0;
-
-  // Break down into 2 sectors if a1 > a2 to preserve directionality
-  if (ta1 > ta2)
+  if (updateRates)
   {
-    ta3 = ta1;
-    ta1 = 0;
+    file = fopen(ratesPath, "w");
+    if (file == NULL)
+    {
+      fprintf(stderr, "cannot write rates file %s\n", ratesPath);
+      return -1;
+    }
+    fprintf(file, "# shapes per second of the fastest of %d rounds\n", GOLDEN_ROUNDS);
+    for (kind = 0; kind < classes; kind++)
+      fprintf(file, "rate %s %.1f\n", goldenClasses[kind], widths * patterns * 2 * GOLDEN_SHAPES / classTime[kind]);
+    fclose(file);
+    printf("recorded rates to %s\n", ratesPath);
   }
 
-  DrawBasicPie(x, y, rx - widthCor, ry - widthCor, ta1, ta2);
-
-  // Draw second part of arc if it loops past start
-  if (ta3)
-    DrawBasicPie(x, y, rx - widthCor, ry - widthCor, ta3, 360);
+  // Throughput fails when a class gets slower than its stored rate by more than the allowed slowdown
+  printf("class      shapes/s     stored  change\n");
+  for (kind = 0; kind < classes; kind++)
+  {
+    rate = widths * patterns * 2 * GOLDEN_SHAPES / classTime[kind];
+    if (updateRates || !goldenRates.count(goldenClasses[kind]))
+    {
+      printf("%-8s %10.1f\n", goldenClasses[kind], rate);
+      continue;
+    }
+    goldenRate = goldenRates[goldenClasses[kind]];
+    printf("%-8s %10.1f %10.1f %+6.1f%%%s\n", goldenClasses[kind], rate, goldenRate, 100 * (rate / goldenRate - 1),
+           rate < goldenRate * (1 - slowdown) ? "  too slow" : "");
+    if (rate < goldenRate * (1 - slowdown))
+      failed++;
+  }
 
-  // Draw outline of pie
-  DrawEllipse(x, y, rx, ry, a1, a2, 1);
+  return failed;
 }
 
 // Function to test drawing
 void draw()
 {
+  // Shapes below overlap heavily, pixels covered by later opaque ones are never drawn
+  BeginOcclusionPass();
+
   // Testing lines
   DrawLine(250, 250, 0, 0, 1);
   DrawLine(250, 250, 125, 0, 1);
@@ -908,6 +4942,7 @@ void draw()
   coords2.push_back(std::make_pair(650, 750));
   DrawFilledPoly(&coords2);
 
+  EndOcclusionPass();
   glutSwapBuffers();
 }
 
@@ -937,6 +4972,28 @@ void keyHandler(unsigned char key, int x, int y)
 
 int main(int argc, char **argv)
 {
+  // Headless modes run without a window
+  if (argc > 1 && !strcmp(argv[1], "--bench-aa"))
+    return BenchAntiAlias(argc > 2 ? atoi(argv[2]) : 4000) ? 1 : 0;
+  if (argc > 2 && !strcmp(argv[1], "--batch"))
+    return RunBatch(argv[2], argc > 3 ? atoi(argv[3]) : 0) ? 1 : 0;
+  if (argc > 2 && !strcmp(argv[1], "--golden"))
+  {
+    const char *rates = NULL;
+    int update = 0;
+    double slowdown = 0.25;
+    for (int i = 3; i < argc; i++)
+    {
+      if (!strcmp(argv[i], "--update"))
+        update = 1;
+      else if (!strcmp(argv[i], "--rates") && i + 1 < argc)
+        rates = argv[++i];
+      else if (!strcmp(argv[i], "--slowdown") && i + 1 < argc)
+        slowdown = atof(argv[++i]);
+    }
+    return RunGolden(argv[2], update, rates, slowdown) ? 1 : 0;
+  }
+
   glutInit(&argc, argv);
   glutInitDisplayMode(GLUT_SINGLE | GLUT_RGBA);
   glutInitWindowSize(winw, winh);